@@ -2,22 +2,60 @@
 // Created by zhangray on 15/3/27.
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <string>
 #include <vector>
+#include <set>
 #include <stack>
 #include <queue>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include "cluster_node.h"
 
 #include "aggl_hier_clusterer.h"
+#include "binary_io.h"
+#include "cluster_checkpoint.h"
+#include "knn_graph.h"
+#include "line_reader.h"
 
 namespace cluster {
 
 static const int maxCharBufferSize = 1 << 11;  // input buffer size 8k
 static const std::string seg = "\t";
+// distances are never negative, so a negative one marks an unloaded pair
+static const float unloadedDistance = -1.0;
+
+// record of a binary distance stream, see initFromBinaryStream()
+struct DistanceRecord {
+    uint32_t left_label;
+    uint32_t right_label;
+    float distance;
+};
+
+static_assert(sizeof(DistanceRecord) == 12, "records are 12 bytes");
+
+// when this few nodes are left the approximate mode compares all the pairs
+static const int completeCandidateNum = 256;
+
+// components of the knn graph up to which the nearest component is found by
+// brute force
+static const int bruteForceComponentNum = 2048;
+
+// order candidates of the approximate mode by distance
+struct CandidateDistanceLess {
+    bool operator()(const std::pair<int, float> &left,
+            const std::pair<int, float> &right) const {
+        return left.second < right.second;
+    }
+};
 
 std::vector<std::string> AgglHierClusterer::splitString(
         std::string input,
@@ -37,6 +75,85 @@ std::vector<std::string> AgglHierClusterer::splitString(
     return result;
 }
 
+// I/O counters of the process. Bytes come from /proc/self/io and stay 0
+// where it does not exist. Dirty pages of a file mapping are written back by
+// the kernel flusher threads and do not show in write_bytes, that is why
+// aggregate() counts the tiles it dirties.
+struct IoCounter {
+    size_t read_bytes;
+    size_t write_bytes;
+    long major_faults;
+};
+
+static void readIoCounter(IoCounter *counter) {
+    counter->read_bytes = 0;
+    counter->write_bytes = 0;
+    FILE *io_file = fopen("/proc/self/io", "r");
+    if (io_file != NULL) {
+        char input_buffer[maxCharBufferSize] = {0};
+        while (fgets(input_buffer, maxCharBufferSize, io_file) != NULL) {
+            unsigned long value = 0;
+            if (sscanf(input_buffer, "read_bytes: %lu", &value) == 1) {
+                counter->read_bytes = value;
+            } else if (sscanf(input_buffer, "write_bytes: %lu", &value) == 1) {
+                counter->write_bytes = value;
+            }
+        }
+        fclose(io_file);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    counter->major_faults = usage.ru_majflt;
+}
+
+static void reportIo(const IoCounter &begin,
+        int merge_num,
+        size_t dirtied_bytes) {
+    if (merge_num <= 0) {
+        return;
+    }
+    IoCounter end;
+    readIoCounter(&end);
+    fprintf(stderr, "I/O of %d merges, per merge: %.1f KB read,"
+            " %.1f KB written, %.1f KB dirtied, %.2f major faults\n",
+            merge_num,
+            (end.read_bytes - begin.read_bytes) / 1024.0 / merge_num,
+            (end.write_bytes - begin.write_bytes) / 1024.0 / merge_num,
+            dirtied_bytes / 1024.0 / merge_num,
+            (double)(end.major_faults - begin.major_faults) / merge_num);
+}
+
+/*
+* Parse a line of the distance file. Return false for comment lines and
+* invalid lines
+*/
+bool AgglHierClusterer::parseDistanceLine(const std::string &line,
+        std::string *left_name,
+        std::string *right_name,
+        float *distance) {
+    if (line.size() <= 0) {  // empty lines
+        return false;
+    }
+    if (line[0] == '#') {  // comment line
+        return false;
+    }
+
+    std::vector<std::string> split_result = splitString(line, seg);
+    if (split_result.size() != 3) {  // invalid line
+        fprintf(stderr, "Invalid line %s\n", line.c_str());
+        return false;
+    }
+    *distance = atof(split_result[2].c_str());
+    if (*distance < 0.0) {
+        fprintf(stderr, "Invalid line: %s, the distance is negative!\n",
+                line.c_str());
+        return false;
+    }
+    *left_name = split_result[0];
+    *right_name = split_result[1];
+    return true;
+}
+
 /*
 * Find the nearest neighbor of node. Return the nearest neighbor's label, while
 * distance is a ret-value parameter indicates the distance between node and it's
@@ -47,6 +164,7 @@ int AgglHierClusterer::findNearestNeighbor(
         float *distance) {
     int distance_matrix_label = node.getDistanceMatrixLabel();
     assert(distance_matrix_label >= 0);
+    prefetchDistanceRow(distance_matrix_label);
     float min_distance = -1.0;  // it is not setted
     int min_distance_node_label = -1;
     for (int i = 0; i < node_num_; ++i) {
@@ -54,7 +172,7 @@ int AgglHierClusterer::findNearestNeighbor(
                 cluster_node_array_[i].getLabel() == node.getLabel()) {
             continue;
         }
-        int distance_index = getDistanceMatrixIndex(
+        size_t distance_index = getDistanceMatrixIndex(
                 distance_matrix_label,
                 cluster_node_array_[i].getDistanceMatrixLabel());
         if (min_distance < 0.0
@@ -67,27 +185,52 @@ int AgglHierClusterer::findNearestNeighbor(
     return min_distance_node_label;
 }
 
+/*
+* Identity of an input file for checkpoints: its real path, size and
+* modification time, only the path for pipes and stdin
+*/
+static std::string describeInputFile(const std::string &path) {
+    char real_path[PATH_MAX] = {0};
+    std::string identity =
+            realpath(path.c_str(), real_path) != NULL ? real_path : path;
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        char buffer[64] = {0};
+        snprintf(buffer, sizeof(buffer), " %lld %lld.%09ld",
+                (long long)file_stat.st_size,
+                (long long)file_stat.st_mtim.tv_sec,
+                file_stat.st_mtim.tv_nsec);
+        identity += buffer;
+    }
+    return identity;
+}
+
 bool AgglHierClusterer::init(int node_num, const std::string &file_name) {
     assert(node_num > 1);
 
+    sample_num_ = node_num;
     base_node_num_ = node_num;
-    cluster_node_array_ =
-            new(std::nothrow) ClusterNode[(base_node_num_ << 1) -1];
-    if (cluster_node_array_ == NULL) {
+    input_identity_ = describeInputFile(file_name);
+    std::vector<std::string> leaf_names;
+    std::vector<int> leaf_sizes;
+    if (duplicate_epsilon_ >= 0.0
+            && !collapseDuplicates(file_name, &leaf_names, &leaf_sizes)) {
+        fprintf(stderr, "Init of clusterer failed,"
+                " cannot collapse duplicate samples\n");
         return false;
     }
+    if (!reserveClusterNodes((base_node_num_ << 1) -1)) {
+        return false;
+    }
+    for (size_t i = 0; i < leaf_names.size(); ++i) {
+        cluster_node_array_[i].init(i, i, leaf_names[i]);
+        cluster_node_array_[i].setBasicNodeNum(leaf_sizes[i]);
+    }
 
     // then create the matrix of the distance
-    size_t distanceEdgeNum =
-            (size_t(base_node_num_) * size_t(base_node_num_ - 1)) >> 1;
-
-    distance_matrix_ = new float[distanceEdgeNum];
-
-    if (distance_matrix_ == NULL) {
+    if (!allocateDistanceMatrix()) {
         return false;
     }
-
-    memset(distance_matrix_, 0, sizeof(float) * distanceEdgeNum);
     // load distance matrix from file
     if (!loadDistanceMatrix(file_name)) {
         fprintf(stderr, "Init of clusterer failed,"
@@ -97,13 +240,461 @@ bool AgglHierClusterer::init(int node_num, const std::string &file_name) {
         fprintf(stderr, "Init success!\n");
     }
     node_num_ = base_node_num_;
+    return resumeIfCheckpointed();
+}
+
+bool AgglHierClusterer::resumeIfCheckpointed() {
+    if (checkpoint_file_.empty()) {
+        return true;
+    }
+    ClusterCheckpoint checkpoint;
+    if (!checkpoint.read(checkpoint_file_)) {
+        return true;
+    }
+    if (checkpoint.input_identity != input_identity_
+            || checkpoint.sample_num != sample_num_
+            || checkpoint.base_node_num != base_node_num_
+            || checkpoint.linkage_type != distance_calculator_type_
+            || checkpoint.duplicate_epsilon != duplicate_epsilon_) {
+        fprintf(stderr, "Checkpoint %s is of another input or linkage,"
+                " ignored\n", checkpoint_file_.c_str());
+        return true;
+    }
+    if (!replayCheckpoint(checkpoint)) {
+        fprintf(stderr, "Init of clusterer failed,"
+                " cannot resume from %s\n", checkpoint_file_.c_str());
+        return false;
+    }
+    fprintf(stderr, "Init success! Resume from %s with %d nodes\n",
+            checkpoint_file_.c_str(), node_num_);
+    return true;
+}
+
+bool AgglHierClusterer::initFromBinaryStream(int node_num,
+        const std::string &name_file_path,
+        const std::string &stream_path) {
+    assert(node_num > 1);
+
+    if (duplicate_epsilon_ >= 0.0) {
+        fprintf(stderr, "Init of clusterer failed, duplicate samples can not"
+                " be collapsed in a binary stream\n");
+        return false;
+    }
+    sample_num_ = node_num;
+    base_node_num_ = node_num;
+    input_identity_ = describeInputFile(name_file_path) + "\n"
+            + describeInputFile(stream_path);
+    node_num_ = 0;
+    if (!reserveClusterNodes((base_node_num_ << 1) -1)
+            || !loadNodeNames(name_file_path)
+            || !allocateDistanceMatrix()) {
+        return false;
+    }
+    if (!loadBinaryStream(stream_path)) {
+        fprintf(stderr, "Init of clusterer failed,"
+                " cannot load distance matrix correctly\n");
+        return false;
+    }
+    fprintf(stderr, "Init success!\n");
+    node_num_ = base_node_num_;
+    return resumeIfCheckpointed();
+}
+
+bool AgglHierClusterer::loadNodeNames(const std::string &file_name) {
+    LineReader name_file;
+    if (!name_file.open(file_name)) {
+        return false;
+    }
+    int label = 0;
+    std::string name;
+    while (name_file.readLine(&name)) {
+        if (label >= base_node_num_ || name.empty()
+                || node_name_map_.find(name) != node_name_map_.end()) {
+            fprintf(stderr, "Invalid name at line %d: %s, empty, duplicate"
+                    " or more than %d names\n", label + 1, name.c_str(),
+                    base_node_num_);
+            return false;
+        }
+        node_name_map_[name] = label;
+        cluster_node_array_[label].init(label, label, name);
+        ++label;
+    }
+    name_file.reportThroughput();
+    if (name_file.isFailed()) {
+        return false;
+    }
+    if (label != base_node_num_) {
+        fprintf(stderr, "Load %d names, %d expected\n", label,
+                base_node_num_);
+        return false;
+    }
+    return true;
+}
+
+/*
+* Load the records of a binary stream, see initFromBinaryStream()
+*/
+bool AgglHierClusterer::loadBinaryStream(const std::string &stream_path) {
+    size_t expected_pair_num =
+            ((size_t)base_node_num_ * (size_t)(base_node_num_ -1)) >> 1;
+    LineReader reader;
+    if (!reader.open(stream_path)) {
+        return false;
+    }
+    size_t loaded_pair_num = 0;
+    const char *block = NULL;
+    size_t block_size = 0;
+    // bytes of a record cut at the end of a block
+    char partial[sizeof(DistanceRecord)];
+    size_t partial_size = 0;
+    DistanceRecord record;
+    while (reader.readBlock(&block, &block_size)) {
+        while (block_size > 0) {
+            const char *data = block;
+            if (partial_size > 0 || block_size < sizeof(DistanceRecord)) {
+                size_t size = std::min(sizeof(DistanceRecord) - partial_size,
+                        block_size);
+                memcpy(partial + partial_size, block, size);
+                partial_size += size;
+                block += size;
+                block_size -= size;
+                if (partial_size < sizeof(DistanceRecord)) {
+                    break;
+                }
+                data = partial;
+                partial_size = 0;
+            } else {
+                block += sizeof(DistanceRecord);
+                block_size -= sizeof(DistanceRecord);
+            }
+            memcpy(&record, data, sizeof(DistanceRecord));
+            if (record.left_label >= (uint32_t)base_node_num_
+                    || record.right_label >= (uint32_t)base_node_num_) {
+                fprintf(stderr, "Invalid label: exceed limit: %u, %u\n",
+                        record.left_label, record.right_label);
+                return false;
+            }
+            if (record.left_label == record.right_label
+                    || !(record.distance >= 0.0)) {
+                fprintf(stderr, "Invalid record: %u, %u, %f\n",
+                        record.left_label, record.right_label,
+                        record.distance);
+                continue;
+            }
+            size_t index = getDistanceMatrixIndex(
+                    (size_t)record.left_label, (size_t)record.right_label);
+            if (distance_matrix_[index] < 0.0) {
+                distance_matrix_[index] = record.distance;
+                loaded_pair_num++;
+                if (loaded_pair_num % 1000000 == 0) {
+                    fprintf(stderr, "%lu pairs loaded\n", loaded_pair_num);
+                }
+            }
+        }
+    }
+    reader.reportThroughput();
+    if (reader.isFailed()) {
+        return false;
+    }
+    if (partial_size > 0) {
+        fprintf(stderr, "The stream ends in the middle of a record\n");
+        return false;
+    }
+    if (loaded_pair_num != expected_pair_num) {
+        fprintf(stderr, "Load %lu pairs, %lu expected, load error!\n",
+                loaded_pair_num, expected_pair_num);
+        return false;
+    }
+    fprintf(stderr, "Load stream success! %lu pairs loaded\n",
+            loaded_pair_num);
+    return true;
+}
+
+/*
+* Create the distance matrix for base_node_num_ nodes, all pairs unloaded
+*/
+bool AgglHierClusterer::allocateDistanceMatrix() {
+    tiled_distance_matrix_ = !out_of_core_file_.empty();
+    size_t distanceEdgeNum = getDistanceMatrixSize(base_node_num_);
+
+    bool matrix_ready = tiled_distance_matrix_ ?
+            distance_matrix_storage_.mapFile(out_of_core_file_,
+                    distanceEdgeNum) :
+            distance_matrix_storage_.allocate(distanceEdgeNum,
+                    distance_matrix_storage_type_);
+    if (!matrix_ready) {
+        return false;
+    }
+    distance_matrix_ = distance_matrix_storage_.getData();
+    if (tiled_distance_matrix_) {
+        tile_write_mark_.assign(
+                (base_node_num_ >> distanceTileShift) + 1, -1);
+    }
+
+    std::fill(distance_matrix_, distance_matrix_ + distanceEdgeNum,
+            unloadedDistance);
+    return true;
+}
+
+/*
+* Load the features of base_node_num_ samples, see initFromFeatures().
+* Sample i of the file gets label i.
+*/
+bool AgglHierClusterer::loadFeatures(const std::string &file_name) {
+    LineReader feature_file;
+    if (!feature_file.open(file_name)) {
+        return false;
+    }
+    feature_dimension_ = 0;
+    features_.clear();
+    int sample_num = 0;
+    std::string line;
+    while (feature_file.readLine(&line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::vector<std::string> split_result = splitString(line, seg);
+        if (split_result.size() < 2) {
+            fprintf(stderr, "Invalid line: %s, no feature!\n", line.c_str());
+            return false;
+        }
+        int dimension = split_result.size() - 1;
+        if (feature_dimension_ == 0) {
+            feature_dimension_ = dimension;
+            features_.reserve((size_t)base_node_num_ * feature_dimension_);
+        } else if (dimension != feature_dimension_) {
+            fprintf(stderr, "Invalid line: %s, %d features instead of %d!\n",
+                    line.c_str(), dimension, feature_dimension_);
+            return false;
+        }
+        if (sample_num >= base_node_num_) {
+            fprintf(stderr, "Too much samples in the file, node num %d\n",
+                    base_node_num_);
+            return false;
+        }
+        const std::string &name = split_result[0];
+        if (node_name_map_.find(name) != node_name_map_.end()) {
+            fprintf(stderr, "Duplicate sample %s\n", name.c_str());
+            return false;
+        }
+        node_name_map_[name] = sample_num;
+        cluster_node_array_[sample_num].init(sample_num, sample_num, name);
+        for (int i = 1; i <= dimension; ++i) {
+            features_.push_back(atof(split_result[i].c_str()));
+        }
+        ++sample_num;
+    }
+    feature_file.reportThroughput();
+    if (feature_file.isFailed()) {
+        return false;
+    }
+    if (sample_num != base_node_num_) {
+        fprintf(stderr, "Load features failed, %d samples instead of %d\n",
+                sample_num, base_node_num_);
+        return false;
+    }
+    return true;
+}
+
+float AgglHierClusterer::getFeatureDistance(int left_dis_label,
+        int left_size,
+        int right_dis_label,
+        int right_size) const {
+    float distance = KnnGraph::squaredDistance(
+            &features_[(size_t)left_dis_label * feature_dimension_],
+            &features_[(size_t)right_dis_label * feature_dimension_],
+            feature_dimension_);
+    if (distance_calculator_type_ != DistanceCalculatorType::CENTROID
+            && distance_calculator_type_ != DistanceCalculatorType::WARD) {
+        distance = sqrt(distance);
+    }
+    return distance_calculator_->weightedDistance(left_size, right_size,
+            distance);
+}
+
+bool AgglHierClusterer::initFromFeatures(int node_num,
+        const std::string &file_name,
+        int knn_k) {
+    assert(node_num > 1);
+
+    if (duplicate_epsilon_ >= 0.0) {
+        fprintf(stderr, "Duplicate samples are not collapsed for features\n");
+        duplicate_epsilon_ = -1.0;
+    }
+    sample_num_ = node_num;
+    base_node_num_ = node_num;
+    input_identity_ = describeInputFile(file_name);
+    node_num_ = 0;
+    if (!reserveClusterNodes((base_node_num_ << 1) -1)
+            || !loadFeatures(file_name)) {
+        fprintf(stderr, "Init of clusterer failed,"
+                " cannot load features correctly\n");
+        return false;
+    }
+    node_num_ = base_node_num_;
+    knn_k_ = knn_k > 0 ? knn_k : 0;
+    if (knn_k_ > 0) {
+        if (!initCandidates()) {
+            return false;
+        }
+        fprintf(stderr, "Init success! Approximate mode with %d neighbors\n",
+                knn_k_);
+        return true;
+    }
+
+    if (!allocateDistanceMatrix()) {
+        return false;
+    }
+    for (int i = 1; i < base_node_num_; ++i) {
+        for (int j = 0; j < i; ++j) {
+            distance_matrix_[getDistanceMatrixIndex(i, j)] =
+                    getFeatureDistance(i, 1, j, 1);
+        }
+    }
+    std::vector<float>().swap(features_);
+    fprintf(stderr, "Init success!\n");
+    return resumeIfCheckpointed();
+}
+
+/*
+* Make room for capacity cluster nodes, keeping the first node_num_ ones
+*/
+bool AgglHierClusterer::reserveClusterNodes(int capacity) {
+    if (cluster_node_array_ != NULL && capacity <= cluster_node_capacity_) {
+        return true;
+    }
+    ClusterNode *new_array = new(std::nothrow) ClusterNode[capacity];
+    if (new_array == NULL) {
+        fprintf(stderr, "Allocate %d cluster nodes failed!\n", capacity);
+        return false;
+    }
+    for (int i = 0; i < node_num_; ++i) {
+        new_array[i] = cluster_node_array_[i];
+    }
+    delete[] cluster_node_array_;
+    cluster_node_array_ = new_array;
+    cluster_node_capacity_ = capacity;
     return true;
 }
 
 AgglHierClusterer::~AgglHierClusterer() {
     delete distance_calculator_;
     delete[] cluster_node_array_;
-    delete[] distance_matrix_;
+}
+
+/*
+* Whether two linkages weight the distances of the given leaves alike, see
+* DistanceCalculator::weightedDistance()
+*/
+static bool isSameLeafWeighting(const DistanceCalculator &left,
+        const DistanceCalculator &right,
+        const ClusterNode *leaves,
+        int leaf_num) {
+    std::set<int> sizes;
+    for (int i = 0; i < leaf_num; ++i) {
+        sizes.insert(leaves[i].getBasicNodeNum());
+    }
+    for (std::set<int>::const_iterator i = sizes.begin(); i != sizes.end();
+            ++i) {
+        for (std::set<int>::const_iterator j = i; j != sizes.end(); ++j) {
+            if (left.weightedDistance(*i, *j, 1.0f)
+                    != right.weightedDistance(*i, *j, 1.0f)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool AgglHierClusterer::initFrom(const AgglHierClusterer &base,
+        bool copy_on_write) {
+    assert(base.cluster_node_array_ != NULL
+            && (base.distance_matrix_ != NULL || base.base_node_num_ < 2));
+    assert(base.node_num_ == base.base_node_num_);  // base not clustered yet
+
+    // the distances of collapsed leaves were weighted for the linkage of
+    // the base when they were loaded
+    if (base.duplicate_epsilon_ >= 0.0
+            && !isSameLeafWeighting(*distance_calculator_,
+                    *base.distance_calculator_, base.cluster_node_array_,
+                    base.base_node_num_)) {
+        fprintf(stderr, "The collapsed duplicates of the base are weighted"
+                " for %s, can not cluster them with %s\n",
+                DistanceCalculatorType::getName(base.distance_calculator_type_),
+                DistanceCalculatorType::getName(distance_calculator_type_));
+        return false;
+    }
+
+    base_node_num_ = base.base_node_num_;
+    node_num_ = 0;
+    if (!reserveClusterNodes((base_node_num_ << 1) -1)) {
+        return false;
+    }
+    for (int i = 0; i < base.node_num_; ++i) {
+        cluster_node_array_[i] = base.cluster_node_array_[i];
+    }
+    node_name_map_ = base.node_name_map_;
+    sample_num_ = base.sample_num_;
+    tiled_distance_matrix_ = base.tiled_distance_matrix_;
+    tile_write_mark_ = base.tile_write_mark_;
+    duplicate_epsilon_ = base.duplicate_epsilon_;
+    duplicate_names_ = base.duplicate_names_;
+
+    bool matrix_ready = false;
+    if (tiled_distance_matrix_) {
+        // neither a heap copy nor the anonymous pages of a copy-on-write
+        // mapping fit in memory, the copy gets a file of its own
+        if (out_of_core_file_.empty()) {
+            fprintf(stderr, "The matrix of the base is out of core,"
+                    " set an out-of-core file for the copy\n");
+            return false;
+        }
+        matrix_ready = distance_matrix_storage_.copyToFile(
+                base.distance_matrix_storage_, out_of_core_file_);
+    } else if (copy_on_write) {
+        matrix_ready = distance_matrix_storage_.mapPrivate(
+                base.distance_matrix_storage_);
+    } else {
+        matrix_ready = distance_matrix_storage_.copyFrom(
+                base.distance_matrix_storage_);
+    }
+    if (!matrix_ready) {
+        fprintf(stderr, "Init of clusterer failed,"
+                " cannot get a copy of the distance matrix\n");
+        return false;
+    }
+    distance_matrix_ = distance_matrix_storage_.getData();
+    node_num_ = base.node_num_;
+    return true;
+}
+
+void AgglHierClusterer::prefetchDistanceRow(size_t dis_label) {
+    if (!tiled_distance_matrix_) {
+        return;
+    }
+    static const size_t tile_edge = 1 << distanceTileShift;
+    static const size_t tile_size = tile_edge * tile_edge;
+    size_t row_tile = dis_label >> distanceTileShift;
+    size_t tile_row_num = ((size_t)base_node_num_ + tile_edge - 1)
+            >> distanceTileShift;
+    // the tiles left of the diagonal are contiguous, below the diagonal
+    // there is one tile per 32 rows; all go to the kernel in one batch
+    prefetch_ranges_.clear();
+    prefetch_ranges_.push_back(std::make_pair(
+            ((row_tile * (row_tile + 1)) >> 1) * tile_size,
+            (row_tile + 1) * tile_size));
+    for (size_t i = row_tile + 1; i < tile_row_num; ++i) {
+        prefetch_ranges_.push_back(std::make_pair(
+                getTiledDistanceMatrixIndex(i << distanceTileShift,
+                        row_tile << distanceTileShift),
+                tile_size));
+    }
+    distance_matrix_storage_.prefetch(prefetch_ranges_);
+}
+
+void AgglHierClusterer::releaseDistanceMatrix() {
+    distance_matrix_storage_.release();
+    distance_matrix_ = NULL;
 }
 
 /*
@@ -115,56 +706,55 @@ AgglHierClusterer::~AgglHierClusterer() {
 *
 * And there is no necessary of repeated node pairs like <ClusterA, ClusterB>
 *     and <ClusterB, ClusterA>
+*
+* When duplicates have been collapsed, the labels are already assigned and
+* only the pairs between the representatives of the classes are loaded.
 */
 bool AgglHierClusterer::loadDistanceMatrix(const std::string &file_name) {
     size_t expected_pair_num =
             ((size_t)base_node_num_ * (size_t)(base_node_num_ -1)) >> 1;
-    assert(cluster_node_array_ != NULL && distance_matrix_ != NULL);
-    FILE *distance_file = NULL;
-    if ((distance_file = fopen(file_name.c_str(), "r")) == NULL) {
-        fprintf(stderr, "Cannot distance file：%s\n", file_name.c_str());
+    assert(cluster_node_array_ != NULL
+            && (distance_matrix_ != NULL || base_node_num_ < 2));
+    LineReader distance_file;
+    if (!distance_file.open(file_name)) {
         return false;
     }
-    char input_buffer[maxCharBufferSize] = {0};
-    int loaded_node_num = 0;
+    bool collapsed = duplicate_epsilon_ >= 0.0;
+    std::string line;
+    int loaded_node_num = collapsed ? base_node_num_ : 0;
     size_t loaded_pair_num = 0;
+    std::string left_name;
+    std::string right_name;
+    float distance = 0.0;
 
-    while (fgets(input_buffer, maxCharBufferSize, distance_file) != NULL) {
-        std::string line(input_buffer);
-        if (line.size() <= 0) {  // empty lines
-            continue;
-        }
-        if (line[0] == '#') {  // comment line
-            continue;
-        }
-
-        std::vector<std::string> split_result = splitString(line, seg);
-        if (split_result.size() != 3) {  // invalid line
-            fprintf(stderr, "Invalid line %s", line.c_str());
+    while (distance_file.readLine(&line)) {
+        if (!parseDistanceLine(line, &left_name, &right_name, &distance)) {
             continue;
         }
 
         int left_label = -1;
         int right_label = -1;
+        std::map<std::string, int>::const_iterator left_it =
+                node_name_map_.find(left_name);
+        std::map<std::string, int>::const_iterator right_it =
+                node_name_map_.find(right_name);
 
-        if (node_name_map_.find(split_result[0]) != node_name_map_.end()) {
-            left_label = node_name_map_.find(split_result[0])->second;
-        } else {
+        if (left_it != node_name_map_.end()) {
+            left_label = left_it->second;
+        } else if (!collapsed) {
             left_label = loaded_node_num++;
             node_name_map_.insert(
-                    std::pair<std::string, int>(split_result[0], left_label));
+                    std::pair<std::string, int>(left_name, left_label));
         }
 
-        if (node_name_map_.find(split_result[1]) != node_name_map_.end()) {
-            right_label = node_name_map_.find(split_result[1])->second;
-        } else {
+        if (right_it != node_name_map_.end()) {
+            right_label = right_it->second;
+        } else if (!collapsed) {
             right_label = loaded_node_num++;
             node_name_map_.insert(
-                    std::pair<std::string, int>(split_result[1], right_label));
+                    std::pair<std::string, int>(right_name, right_label));
         }
 
-        float distance = atof(split_result[2].c_str());
-
         if (left_label < 0
                 || left_label >= base_node_num_
                 || right_label < 0
@@ -175,23 +765,37 @@ bool AgglHierClusterer::loadDistanceMatrix(const std::string &file_name) {
         }
 
         if (left_label == right_label) {
-            fprintf(stderr, "Invalid line: %s, the paired nodes is the same!\n", line.c_str());  // NOLINT
+            if (!collapsed) {
+                fprintf(stderr, "Invalid line: %s, the paired nodes is the same!\n", line.c_str());  // NOLINT
+            }
             continue;
         }
 
         if (cluster_node_array_[left_label].getLabel() < 0) {
             cluster_node_array_[left_label].init(
-                    left_label, left_label, split_result[0]);
+                    left_label, left_label, left_name);
         }
 
         if (cluster_node_array_[right_label].getLabel() < 0) {
             cluster_node_array_[right_label].init(
-                    right_label, right_label, split_result[1]);
+                    right_label, right_label, right_name);
+        }
+
+        if (collapsed && (
+                cluster_node_array_[left_label].getClusterName() != left_name
+                || cluster_node_array_[right_label].getClusterName() != right_name)) {  // NOLINT
+            continue;  // a duplicate, its representative's pair is used
         }
 
         size_t index = getDistanceMatrixIndex(left_label, right_label);
 
-        if (distance_matrix_[index] <= 0.0) {
+        if (distance_matrix_[index] < 0.0) {
+            if (collapsed) {
+                distance = distance_calculator_->weightedDistance(
+                        cluster_node_array_[left_label].getBasicNodeNum(),
+                        cluster_node_array_[right_label].getBasicNodeNum(),
+                        distance);
+            }
             distance_matrix_[index] = distance;
             loaded_pair_num++;
             if (loaded_pair_num % 1000000 == 0) {
@@ -199,6 +803,11 @@ bool AgglHierClusterer::loadDistanceMatrix(const std::string &file_name) {
             }
         }
     }
+    distance_file.reportThroughput();
+    if (distance_file.isFailed()) {
+        fprintf(stderr, "Read distance file %s failed!\n", file_name.c_str());
+        return false;
+    }
     if (loaded_node_num != base_node_num_ ||
             loaded_pair_num != expected_pair_num) {
         fprintf(stderr, "Load %d nodes and %lu pairs, load error!\n",
@@ -207,7 +816,108 @@ bool AgglHierClusterer::loadDistanceMatrix(const std::string &file_name) {
     }
     fprintf(stderr, "Load file success! %d nodes and %lu pairs loaded\n",
             loaded_node_num, loaded_pair_num);
-    fclose(distance_file);
+    return true;
+}
+
+/*
+* Find the class representative of label in the union-find forest, with path
+* halving
+*/
+static int findClass(std::vector<int> *parent, int label) {
+    while ((*parent)[label] != label) {
+        (*parent)[label] = (*parent)[(*parent)[label]];
+        label = (*parent)[label];
+    }
+    return label;
+}
+
+/*
+* First pass over the distance file: union the samples whose distance is not
+* bigger than duplicate_epsilon_ and give each class one label. The first
+* sample seen of a class is its representative: it becomes the leaf of the
+* class, and its distances to the other representatives are used for the
+* whole class. The other names of the class are kept in duplicate_names_
+* and expanded again by output().
+*/
+bool AgglHierClusterer::collapseDuplicates(const std::string &file_name,
+        std::vector<std::string> *leaf_names,
+        std::vector<int> *leaf_sizes) {
+    LineReader distance_file;
+    if (!distance_file.open(file_name)) {
+        return false;
+    }
+    std::string line;
+    std::vector<std::string> sample_names;
+    std::vector<int> parent;
+    std::string left_name;
+    std::string right_name;
+    float distance = 0.0;
+
+    while (distance_file.readLine(&line)) {
+        if (!parseDistanceLine(line, &left_name, &right_name, &distance)) {
+            continue;
+        }
+        int labels[2] = {-1, -1};
+        const std::string *names[2] = {&left_name, &right_name};
+        for (int k = 0; k < 2; ++k) {
+            std::map<std::string, int>::const_iterator it =
+                    node_name_map_.find(*names[k]);
+            if (it != node_name_map_.end()) {
+                labels[k] = it->second;
+            } else {
+                labels[k] = sample_names.size();
+                node_name_map_.insert(
+                        std::pair<std::string, int>(*names[k], labels[k]));
+                sample_names.push_back(*names[k]);
+                parent.push_back(labels[k]);
+            }
+        }
+        if (distance <= duplicate_epsilon_ && labels[0] != labels[1]) {
+            int left_class = findClass(&parent, labels[0]);
+            int right_class = findClass(&parent, labels[1]);
+            // the earlier sample stays the representative
+            if (left_class < right_class) {
+                parent[right_class] = left_class;
+            } else if (right_class < left_class) {
+                parent[left_class] = right_class;
+            }
+        }
+    }
+    distance_file.reportThroughput();
+    if (distance_file.isFailed()) {
+        fprintf(stderr, "Read distance file %s failed!\n", file_name.c_str());
+        node_name_map_.clear();
+        return false;
+    }
+    if ((int)sample_names.size() != sample_num_) {
+        fprintf(stderr, "Find %lu samples, but %d expected!\n",
+                sample_names.size(), sample_num_);
+        node_name_map_.clear();
+        return false;
+    }
+
+    // representatives get increasing leaf labels, members follow them
+    std::vector<int> class_label(sample_num_, -1);
+    leaf_names->clear();
+    leaf_sizes->clear();
+    duplicate_names_.clear();
+    for (int i = 0; i < sample_num_; ++i) {
+        int representative = findClass(&parent, i);
+        if (representative == i) {
+            class_label[i] = leaf_names->size();
+            leaf_names->push_back(sample_names[i]);
+            leaf_sizes->push_back(1);
+            duplicate_names_.push_back(std::vector<std::string>());
+        } else {
+            int label = class_label[representative];
+            (*leaf_sizes)[label]++;
+            duplicate_names_[label].push_back(sample_names[i]);
+        }
+        node_name_map_[sample_names[i]] = class_label[representative];
+    }
+    base_node_num_ = leaf_names->size();
+    fprintf(stderr, "Collapse %d samples into %d classes\n",
+            sample_num_, base_node_num_);
     return true;
 }
 
@@ -215,16 +925,43 @@ bool AgglHierClusterer::loadDistanceMatrix(const std::string &file_name) {
 * Aggregate all the node's into one
 */
 bool AgglHierClusterer::doCluster() {
-    std::stack<int> nearest_neighbor_chain;
-    nearest_neighbor_chain.push(0);
+    if (node_num_ == (base_node_num_ << 1) - 1) {
+        // all the samples are duplicates of one sample
+        return true;
+    }
+    if (knn_k_ > 0) {
+        return doApproximateCluster();
+    }
+    bool report_io = io_report_interval_ > 0 || tiled_distance_matrix_;
+    IoCounter begin_io;
+    readIoCounter(&begin_io);
+    dirtied_tile_num_ = 0;
+    static const size_t tile_bytes =
+            sizeof(float) << (distanceTileShift << 1);
 
-    // Current end of the nearest neighbor chain
-    ClusterNode* top_node = &cluster_node_array_[nearest_neighbor_chain.top()];
+    bool checkpoint_enabled =
+            !checkpoint_file_.empty() && checkpoint_interval_ > 0;
+    CheckpointWriter checkpoint_writer(checkpoint_file_);
+    time_t checkpoint_time = time(NULL);
 
+    // bottom to top, the back is the top of the chain
+    std::vector<int> nearest_neighbor_chain;
+    ClusterNode* top_node = NULL;
     float nearest_distance = 0.0;
     // The node which ready to add to the nearest neighbor chain
-    int nearest_neighbor_label =
-            findNearestNeighbor(*top_node, &nearest_distance);
+    int nearest_neighbor_label = -1;
+    if (!resumed_chain_.empty()) {
+        nearest_neighbor_chain.swap(resumed_chain_);
+        top_node = &cluster_node_array_[nearest_neighbor_chain.back()];
+        nearest_neighbor_label = resumed_nearest_neighbor_label_;
+        nearest_distance = resumed_nearest_distance_;
+    } else {
+        nearest_neighbor_chain.push_back(0);
+        // Current end of the nearest neighbor chain
+        top_node = &cluster_node_array_[nearest_neighbor_chain.back()];
+        nearest_neighbor_label =
+                findNearestNeighbor(*top_node, &nearest_distance);
+    }
     ClusterNode* nearest_neighbor = &cluster_node_array_[nearest_neighbor_label];
 
     while (!nearest_neighbor_chain.empty()) {
@@ -232,59 +969,418 @@ bool AgglHierClusterer::doCluster() {
             fprintf(stderr, "Agglometive hierical cluster success!\n");
             break;
         }
+        if (checkpoint_enabled && !checkpoint_writer.isBusy()
+                && time(NULL) - checkpoint_time >= checkpoint_interval_) {
+            // only the merges are copied here, they are written in background
+            checkpoint_writer.write(takeCheckpoint(nearest_neighbor_chain,
+                    nearest_neighbor_label,
+                    nearest_distance));
+            checkpoint_time = time(NULL);
+        }
         float next_nearest_distance = 0.0;
         // The next node of the nearest neighbor chain
         int next_node_label = findNearestNeighbor(*nearest_neighbor,
                 &next_nearest_distance);
+        if (next_node_label != top_node->getLabel()
+                && std::find(nearest_neighbor_chain.begin(),
+                        nearest_neighbor_chain.end(), next_node_label)
+                        != nearest_neighbor_chain.end()) {
+            // CENTROID is not reducible, a merge may bring a node closer
+            // than the chain below it: cut the chain at the node, so that
+            // it is merged with the nearest neighbor instead of being pushed
+            // twice
+            while (nearest_neighbor_chain.back() != next_node_label) {
+                nearest_neighbor_chain.pop_back();
+            }
+            top_node = &cluster_node_array_[next_node_label];
+            nearest_distance = next_nearest_distance;
+        }
 
         if (next_node_label == top_node->getLabel()) {
             // aggregate the top node and it's nearest neighbor
-            nearest_neighbor_chain.pop();
+            nearest_neighbor_chain.pop_back();
             int new_node_label = aggregate(top_node,
                     nearest_neighbor,
                     nearest_distance);
+            int merge_num = node_num_ - base_node_num_;
+            if (io_report_interval_ > 0
+                    && merge_num % io_report_interval_ == 0) {
+                reportIo(begin_io, merge_num, dirtied_tile_num_ * tile_bytes);
+            }
 
             if (nearest_neighbor_chain.empty()) {
-                nearest_neighbor_chain.push(new_node_label);
+                nearest_neighbor_chain.push_back(new_node_label);
             }
             // then find the nearest neighbor of the top;
             // update the loop's condition
             if (nearest_neighbor_chain.size() == 1) {
-                top_node = &cluster_node_array_[nearest_neighbor_chain.top()];
+                top_node = &cluster_node_array_[nearest_neighbor_chain.back()];
                 nearest_neighbor_label = findNearestNeighbor(*top_node,
                                                              &nearest_distance);
             } else {
                 // length of current nearest neighbor chain is bigger than 2
-                nearest_neighbor_label = nearest_neighbor_chain.top();
-                nearest_neighbor_chain.pop();
-                top_node = &cluster_node_array_[nearest_neighbor_chain.top()];
+                nearest_neighbor_label = nearest_neighbor_chain.back();
+                nearest_neighbor_chain.pop_back();
+                top_node = &cluster_node_array_[nearest_neighbor_chain.back()];
                 nearest_distance = distance_matrix_[getDistanceMatrixIndex(
-                        top_node->getDistanceMatrixLabel(),
-                        nearest_neighbor_label
+                        *top_node,
+                        cluster_node_array_[nearest_neighbor_label]
                 )];
             }
         } else {  // push the next node in to stack and goto next
-            nearest_neighbor_chain.push(nearest_neighbor_label);
+            nearest_neighbor_chain.push_back(nearest_neighbor_label);
             top_node = nearest_neighbor;
             nearest_neighbor_label = next_node_label;
             nearest_distance = next_nearest_distance;
         }
         nearest_neighbor = &cluster_node_array_[nearest_neighbor_label];
     }
+    if (report_io) {
+        reportIo(begin_io, node_num_ - base_node_num_,
+                dirtied_tile_num_ * tile_bytes);
+    }
+    if (checkpoint_enabled) {
+        // the cluster is complete, nothing to resume any more
+        checkpoint_writer.wait();
+        remove(checkpoint_file_.c_str());
+    }
     return true;
 }
 
 /*
-* Aggregate two cluster nodes to a new node.
-* The new node will be pushed into the cluster node array.
-* And then the distance matrix will be updated
+* Snapshot the state of doCluster(): the merged nodes and the chain, the
+* matrix follows from them
 */
-int AgglHierClusterer::aggregate(
-        ClusterNode *left_node,
+ClusterCheckpoint *AgglHierClusterer::takeCheckpoint(
+        const std::vector<int> &chain,
+        int nearest_neighbor_label,
+        float nearest_distance) {
+    ClusterCheckpoint *checkpoint = new ClusterCheckpoint();
+    checkpoint->linkage_type = distance_calculator_type_;
+    checkpoint->base_node_num = base_node_num_;
+    checkpoint->sample_num = sample_num_;
+    checkpoint->duplicate_epsilon = duplicate_epsilon_;
+    checkpoint->input_identity = input_identity_;
+    checkpoint->merges.assign(cluster_node_array_ + base_node_num_,
+            cluster_node_array_ + node_num_);
+    checkpoint->chain = chain;
+    checkpoint->nearest_neighbor_label = nearest_neighbor_label;
+    checkpoint->nearest_distance = nearest_distance;
+    return checkpoint;
+}
+
+/*
+* Redo the merges of a checkpoint of the same input in their order. The
+* matrix updates are deterministic, so the matrix ends up as it was when the
+* checkpoint was taken.
+*/
+bool AgglHierClusterer::replayCheckpoint(
+        const ClusterCheckpoint &checkpoint) {
+    assert(node_num_ == base_node_num_);
+    for (size_t i = 0; i < checkpoint.merges.size(); ++i) {
+        int left_label = checkpoint.merges[i].getLeftChildLabel();
+        int right_label = checkpoint.merges[i].getRightChildLabel();
+        bool valid = left_label >= 0 && left_label < node_num_
+                && right_label >= 0 && right_label < node_num_
+                && left_label != right_label;
+        ClusterNode *left_node =
+                valid ? &cluster_node_array_[left_label] : NULL;
+        ClusterNode *right_node =
+                valid ? &cluster_node_array_[right_label] : NULL;
+        if (!valid || left_node->getDistanceMatrixLabel() < 0
+                || right_node->getDistanceMatrixLabel() < 0) {
+            fprintf(stderr, "Invalid merge of %d and %d in checkpoint\n",
+                    left_label, right_label);
+            return false;
+        }
+        aggregate(left_node, right_node, checkpoint.merges[i].getDistance());
+    }
+    std::vector<int> labels(checkpoint.chain);
+    labels.push_back(checkpoint.nearest_neighbor_label);
+    for (size_t i = 0; i < labels.size(); ++i) {
+        if (labels[i] < 0 || labels[i] >= node_num_
+                || cluster_node_array_[labels[i]].getDistanceMatrixLabel()
+                        < 0) {
+            fprintf(stderr, "Invalid chain node %d in checkpoint\n",
+                    labels[i]);
+            return false;
+        }
+    }
+    resumed_chain_ = checkpoint.chain;
+    resumed_nearest_neighbor_label_ = checkpoint.nearest_neighbor_label;
+    resumed_nearest_distance_ = checkpoint.nearest_distance;
+    return true;
+}
+
+/*
+* Build the knn graph of the samples and make it the symmetric candidate
+* lists of the approximate mode
+*/
+bool AgglHierClusterer::initCandidates() {
+    KnnGraph knn_graph;
+    if (!knn_graph.build(&features_[0], base_node_num_, feature_dimension_,
+            knn_k_)) {
+        return false;
+    }
+    candidates_.assign(base_node_num_, std::vector<Candidate>());
+    dis_label_owners_.resize(base_node_num_);
+    for (int u = 0; u < base_node_num_; ++u) {
+        dis_label_owners_[u] = u;
+        for (int i = 0; i < knn_graph.getK(); ++i) {
+            int v = knn_graph.getNeighbor(u, i);
+            if (v < 0) {
+                break;
+            }
+            float distance = getFeatureDistance(u, 1, v, 1);
+            candidates_[u].push_back(Candidate(v, distance));
+            candidates_[v].push_back(Candidate(u, distance));
+        }
+    }
+    // u and v may know each other twice, if each is a neighbor of the other
+    for (int u = 0; u < base_node_num_; ++u) {
+        std::vector<Candidate> &candidates = candidates_[u];
+        std::sort(candidates.begin(), candidates.end());
+        std::vector<Candidate>::iterator end = candidates.begin();
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            if (end == candidates.begin()
+                    || (end - 1)->first != candidates[i].first) {
+                *end++ = candidates[i];
+            }
+        }
+        candidates.erase(end, candidates.end());
+    }
+    connectCandidates();
+    return true;
+}
+
+/*
+* A merged node knows the union of its children's candidates, so a node only
+* runs out of candidates once it holds a whole connected component of the
+* candidate graph. Link the components up front, so that this never happens:
+* each component is represented by its sample closest to the centroid, and
+* every representative is linked to the nearest representative of another
+* component, until one component is left. The nearest representatives come
+* from a knn graph of the representatives when there are many of them. Each
+* round at least halves the components, the cost of a round is O(n).
+*/
+void AgglHierClusterer::connectCandidates() {
+    std::vector<int> parent(base_node_num_);
+    for (int i = 0; i < base_node_num_; ++i) {
+        parent[i] = i;
+    }
+    for (int u = 0; u < base_node_num_; ++u) {
+        for (size_t i = 0; i < candidates_[u].size(); ++i) {
+            parent[findClass(&parent, u)] =
+                    findClass(&parent, candidates_[u][i].first);
+        }
+    }
+    size_t dimension = feature_dimension_;
+    bool reported = false;
+    while (true) {
+        std::vector<int> component_ids(base_node_num_, -1);  // by class
+        std::vector<int> components(base_node_num_);
+        int component_num = 0;
+        for (int i = 0; i < base_node_num_; ++i) {
+            int representative = findClass(&parent, i);
+            if (component_ids[representative] < 0) {
+                component_ids[representative] = component_num++;
+            }
+            components[i] = component_ids[representative];
+        }
+        if (component_num == 1) {
+            return;
+        }
+        if (!reported) {
+            fprintf(stderr, "Link %d components of the knn graph\n",
+                    component_num);
+            reported = true;
+        }
+
+        std::vector<float> centroids(component_num * dimension, 0.0);
+        std::vector<int> sizes(component_num, 0);
+        for (int i = 0; i < base_node_num_; ++i) {
+            const float *features = &features_[i * dimension];
+            float *centroid = &centroids[components[i] * dimension];
+            for (size_t j = 0; j < dimension; ++j) {
+                centroid[j] += features[j];
+            }
+            sizes[components[i]]++;
+        }
+        for (int c = 0; c < component_num; ++c) {
+            for (size_t j = 0; j < dimension; ++j) {
+                centroids[c * dimension + j] /= sizes[c];
+            }
+        }
+        std::vector<int> representatives(component_num, -1);
+        std::vector<float> representative_distances(component_num, 0.0);
+        for (int i = 0; i < base_node_num_; ++i) {
+            int c = components[i];
+            float distance = KnnGraph::squaredDistance(
+                    &features_[i * dimension], &centroids[c * dimension],
+                    feature_dimension_);
+            if (representatives[c] < 0
+                    || distance < representative_distances[c]) {
+                representatives[c] = i;
+                representative_distances[c] = distance;
+            }
+        }
+        std::vector<float> representative_features(
+                component_num * dimension);
+        for (int c = 0; c < component_num; ++c) {
+            std::copy(&features_[representatives[c] * dimension],
+                    &features_[representatives[c] * dimension] + dimension,
+                    &representative_features[c * dimension]);
+        }
+
+        std::vector<int> nearest(component_num, -1);
+        KnnGraph knn_graph;
+        if (component_num > bruteForceComponentNum
+                && knn_graph.build(&representative_features[0],
+                        component_num, feature_dimension_, knn_k_)) {
+            for (int c = 0; c < component_num; ++c) {
+                nearest[c] = knn_graph.getNeighbor(c, 0);
+            }
+        } else {
+            for (int c = 0; c < component_num; ++c) {
+                float nearest_distance = 0.0;
+                for (int d = 0; d < component_num; ++d) {
+                    float distance = KnnGraph::squaredDistance(
+                            &representative_features[c * dimension],
+                            &representative_features[d * dimension],
+                            feature_dimension_);
+                    if (d != c && (nearest[c] < 0
+                            || distance < nearest_distance)) {
+                        nearest[c] = d;
+                        nearest_distance = distance;
+                    }
+                }
+            }
+        }
+
+        bool linked = false;
+        for (int c = 0; c < component_num; ++c) {
+            // a representative without a neighbor is linked to the next one
+            int d = nearest[c] >= 0 ? nearest[c] : (c + 1) % component_num;
+            int u = representatives[c];
+            int v = representatives[d];
+            if (findClass(&parent, u) == findClass(&parent, v)) {
+                continue;
+            }
+            float distance = getFeatureDistance(u, 1, v, 1);
+            candidates_[u].push_back(Candidate(v, distance));
+            candidates_[v].push_back(Candidate(u, distance));
+            parent[findClass(&parent, u)] = findClass(&parent, v);
+            linked = true;
+        }
+        assert(linked);
+    }
+}
+
+void AgglHierClusterer::completeCandidates() {
+    std::vector<char> known(dis_label_owners_.size(), 0);
+    for (size_t i = 0; i < dis_label_owners_.size(); ++i) {
+        if (dis_label_owners_[i] < 0) {
+            continue;
+        }
+        std::vector<Candidate> &candidates = candidates_[i];
+        for (size_t j = 0; j < candidates.size(); ++j) {
+            known[candidates[j].first] = 1;
+        }
+        int size = cluster_node_array_[dis_label_owners_[i]].getBasicNodeNum();
+        // the pairs with a smaller dis label are complete already
+        for (size_t j = i + 1; j < dis_label_owners_.size(); ++j) {
+            if (dis_label_owners_[j] < 0 || known[j]) {
+                continue;
+            }
+            float distance = getFeatureDistance(i, size, j,
+                    cluster_node_array_[dis_label_owners_[j]]
+                            .getBasicNodeNum());
+            candidates.push_back(Candidate(j, distance));
+            candidates_[j].push_back(Candidate(i, distance));
+        }
+        for (size_t j = 0; j < candidates.size(); ++j) {
+            known[candidates[j].first] = 0;
+        }
+    }
+}
+
+/*
+* Nearest neighbor chain over the candidate lists. Ties go to the previous
+* node of the chain, like in doCluster(). The approximate distances are not
+* always reducible, so the nearest candidate of the top may be deeper in the
+* chain: then the chain is cut there and the two nodes are merged.
+*/
+bool AgglHierClusterer::doApproximateCluster() {
+    std::vector<int> nearest_neighbor_chain;  // node labels
+    std::vector<char> on_chain(base_node_num_, 0);  // by dis label
+    int first_live_label = 0;  // no live node has a smaller label
+    bool complete = false;
+    while (node_num_ < (base_node_num_ << 1) - 1) {
+        if (!complete
+                && (base_node_num_ << 1) - node_num_ <= completeCandidateNum) {
+            completeCandidates();
+            complete = true;
+        }
+        if (nearest_neighbor_chain.empty()) {
+            while (cluster_node_array_[first_live_label]
+                    .getDistanceMatrixLabel() < 0) {
+                ++first_live_label;
+            }
+            nearest_neighbor_chain.push_back(first_live_label);
+            on_chain[cluster_node_array_[first_live_label]
+                    .getDistanceMatrixLabel()] = 1;
+        }
+        ClusterNode *top_node =
+                &cluster_node_array_[nearest_neighbor_chain.back()];
+        int top_dis_label = top_node->getDistanceMatrixLabel();
+        // the candidate graph is connected, see connectCandidates()
+        assert(!candidates_[top_dis_label].empty());
+        int previous_dis_label = nearest_neighbor_chain.size() < 2 ? -1 :
+                cluster_node_array_[nearest_neighbor_chain[
+                        nearest_neighbor_chain.size() - 2]]
+                        .getDistanceMatrixLabel();
+        const std::vector<Candidate> &candidates = candidates_[top_dis_label];
+        const Candidate *nearest = &candidates[0];
+        for (size_t i = 1; i < candidates.size(); ++i) {
+            if (candidates[i].second < nearest->second
+                    || (candidates[i].second == nearest->second
+                    && candidates[i].first == previous_dis_label)) {
+                nearest = &candidates[i];
+            }
+        }
+        int nearest_dis_label = nearest->first;
+        float nearest_distance = nearest->second;
+        if (!on_chain[nearest_dis_label]) {
+            nearest_neighbor_chain.push_back(
+                    dis_label_owners_[nearest_dis_label]);
+            on_chain[nearest_dis_label] = 1;
+            continue;
+        }
+        // pop the chain down to the nearest neighbor
+        int nearest_neighbor_label = dis_label_owners_[nearest_dis_label];
+        while (true) {
+            int label = nearest_neighbor_chain.back();
+            nearest_neighbor_chain.pop_back();
+            on_chain[cluster_node_array_[label].getDistanceMatrixLabel()] = 0;
+            if (label == nearest_neighbor_label) {
+                break;
+            }
+        }
+        aggregateCandidates(top_node,
+                &cluster_node_array_[nearest_neighbor_label],
+                nearest_distance);
+    }
+    fprintf(stderr, "Agglometive hierical cluster success!\n");
+    std::vector<std::vector<Candidate> >().swap(candidates_);
+    std::vector<int>().swap(dis_label_owners_);
+    std::vector<float>().swap(features_);
+    knn_k_ = 0;
+    return true;
+}
+
+ClusterNode *AgglHierClusterer::createMergedNode(ClusterNode *left_node,
         ClusterNode *right_node,
         float distance) {
-    assert(left_node != NULL && right_node != NULL);
-    // new node
     int left_node_dis_label = left_node->getDistanceMatrixLabel();
     int right_node_dis_label = right_node->getDistanceMatrixLabel();
     left_node->setDistanceMatrixLabel(-1);
@@ -292,13 +1388,34 @@ int AgglHierClusterer::aggregate(
     int new_node_dis_label =
             left_node_dis_label < right_node_dis_label ?
                     left_node_dis_label : right_node_dis_label;
-    cluster_node_array_[node_num_].setLabel(node_num_);
-    cluster_node_array_[node_num_].setBasicNodeNum(
+    ClusterNode &new_node = cluster_node_array_[node_num_];
+    new_node.setLabel(node_num_);
+    new_node.setBasicNodeNum(
             left_node->getBasicNodeNum() + right_node->getBasicNodeNum());
-    cluster_node_array_[node_num_].setLeftChildLabel(left_node->getLabel());
-    cluster_node_array_[node_num_].setRightChildLabel(right_node->getLabel());  // NOLINT
-    cluster_node_array_[node_num_].setDistanceMatrixLabel(new_node_dis_label);  // NOLINT
-    cluster_node_array_[node_num_].setDistance(distance);
+    new_node.setLeftChildLabel(left_node->getLabel());
+    new_node.setRightChildLabel(right_node->getLabel());
+    new_node.setDistanceMatrixLabel(new_node_dis_label);
+    new_node.setDistance(distance);
+    return &new_node;
+}
+
+/*
+* Aggregate two cluster nodes to a new node.
+* The new node will be pushed into the cluster node array.
+* And then the distance matrix will be updated
+*/
+int AgglHierClusterer::aggregate(
+        ClusterNode *left_node,
+        ClusterNode *right_node,
+        float distance) {
+    assert(left_node != NULL && right_node != NULL);
+    int left_node_dis_label = left_node->getDistanceMatrixLabel();
+    int right_node_dis_label = right_node->getDistanceMatrixLabel();
+    prefetchDistanceRow(left_node_dis_label);
+    prefetchDistanceRow(right_node_dis_label);
+    // new node
+    int new_node_dis_label = createMergedNode(left_node, right_node,
+            distance)->getDistanceMatrixLabel();
 
     // then update the distance matrix
     int cur_dis_label = -1;
@@ -322,6 +1439,14 @@ int AgglHierClusterer::aggregate(
                 distance
         );
         distance_matrix_[getDistanceMatrixIndex(cur_dis_label, new_node_dis_label)] = cur_new_dis;  // NOLINT
+        if (tiled_distance_matrix_) {
+            // all the pairs of new node in a tile column share one tile
+            int tile_column = cur_dis_label >> distanceTileShift;
+            if (tile_write_mark_[tile_column] != node_num_) {
+                tile_write_mark_[tile_column] = node_num_;
+                dirtied_tile_num_++;
+            }
+        }
     }
 
     // update distance matrix end; merge complete
@@ -329,6 +1454,163 @@ int AgglHierClusterer::aggregate(
     return cluster_node_array_[node_num_ - 1].getLabel();
 }
 
+/*
+* Aggregate two nodes of the approximate mode. The candidates of the new node
+* are the union of the children's. A child which does not know a candidate
+* gets its centroid distance to the candidate, then the Lance-Williams
+* update gives the distance to the new node as usual. The centroid of the new
+* node is the weighted mean of the children's.
+*/
+int AgglHierClusterer::aggregateCandidates(ClusterNode *left_node,
+        ClusterNode *right_node,
+        float distance) {
+    assert(left_node != NULL && right_node != NULL);
+    int left_dis_label = left_node->getDistanceMatrixLabel();
+    int right_dis_label = right_node->getDistanceMatrixLabel();
+    int left_size = left_node->getBasicNodeNum();
+    int right_size = right_node->getBasicNodeNum();
+
+    // side 0 for the candidates of the left child, 1 for the right's
+    std::vector<std::pair<int, std::pair<int, float> > > children_candidates;
+    for (int side = 0; side < 2; ++side) {
+        const std::vector<Candidate> &candidates =
+                candidates_[side == 0 ? left_dis_label : right_dis_label];
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            if (candidates[i].first != left_dis_label
+                    && candidates[i].first != right_dis_label) {
+                children_candidates.push_back(std::make_pair(
+                        candidates[i].first,
+                        std::make_pair(side, candidates[i].second)));
+            }
+        }
+    }
+    std::sort(children_candidates.begin(), children_candidates.end());
+
+    std::vector<Candidate> new_candidates;
+    for (size_t i = 0; i < children_candidates.size(); ++i) {
+        int cur_dis_label = children_candidates[i].first;
+        int cur_size = cluster_node_array_[dis_label_owners_[cur_dis_label]]
+                .getBasicNodeNum();
+        float cur_left_dis = 0.0;
+        float cur_right_dis = 0.0;
+        if (i + 1 < children_candidates.size()
+                && children_candidates[i + 1].first == cur_dis_label) {
+            // both children know it, sorted left first
+            cur_left_dis = children_candidates[i].second.second;
+            cur_right_dis = children_candidates[i + 1].second.second;
+            ++i;
+        } else if (children_candidates[i].second.first == 0) {
+            cur_left_dis = children_candidates[i].second.second;
+            cur_right_dis = getFeatureDistance(right_dis_label, right_size,
+                    cur_dis_label, cur_size);
+        } else {
+            cur_left_dis = getFeatureDistance(left_dis_label, left_size,
+                    cur_dis_label, cur_size);
+            cur_right_dis = children_candidates[i].second.second;
+        }
+        new_candidates.push_back(Candidate(cur_dis_label,
+                (*distance_calculator_)(left_size,
+                        right_size,
+                        cur_size,
+                        cur_left_dis,
+                        cur_right_dis,
+                        distance)));
+    }
+
+    ClusterNode *new_node = createMergedNode(left_node, right_node, distance);
+    int new_dis_label = new_node->getDistanceMatrixLabel();
+    int freed_dis_label = new_dis_label == left_dis_label ?
+            right_dis_label : left_dis_label;
+    float *left_features = &features_[(size_t)left_dis_label
+            * feature_dimension_];
+    float *right_features = &features_[(size_t)right_dis_label
+            * feature_dimension_];
+    float *new_features = &features_[(size_t)new_dis_label
+            * feature_dimension_];
+    for (int i = 0; i < feature_dimension_; ++i) {
+        new_features[i] = (left_size * left_features[i]
+                + right_size * right_features[i]) / (left_size + right_size);
+    }
+
+    // the candidates forget the children and learn the new node
+    for (size_t i = 0; i < new_candidates.size(); ++i) {
+        std::vector<Candidate> &cur_candidates =
+                candidates_[new_candidates[i].first];
+        std::vector<Candidate>::iterator end = cur_candidates.begin();
+        for (size_t j = 0; j < cur_candidates.size(); ++j) {
+            if (cur_candidates[j].first != left_dis_label
+                    && cur_candidates[j].first != right_dis_label) {
+                *end++ = cur_candidates[j];
+            }
+        }
+        cur_candidates.erase(end, cur_candidates.end());
+        cur_candidates.push_back(Candidate(new_dis_label,
+                new_candidates[i].second));
+    }
+    candidates_[new_dis_label].swap(new_candidates);
+    std::vector<Candidate>().swap(candidates_[freed_dis_label]);
+    dis_label_owners_[new_dis_label] = new_node->getLabel();
+    dis_label_owners_[freed_dis_label] = -1;
+
+    node_num_ ++;
+    return new_node->getLabel();
+}
+
+/*
+* Output the names of all the samples in a leaf, tab separated
+*/
+void AgglHierClusterer::outputLeafNames(FILE *out_file,
+        const ClusterNode &leaf_node) {
+    fprintf(out_file, "\t%s", leaf_node.getClusterName().c_str());
+    if (!isCollapsedLeaf(leaf_node)) {
+        return;
+    }
+    const std::vector<std::string> &names =
+            duplicate_names_[leaf_node.getLabel()];
+    for (size_t i = 0; i < names.size(); ++i) {
+        fprintf(out_file, "\t%s", names[i].c_str());
+    }
+}
+
+/*
+* Expand a leaf with duplicates in the tree output: the leaf becomes a
+* chain of merges at distance 0 over its representative and its duplicates.
+* The expanded nodes get labels from next_label on; the next free label is
+* returned.
+*/
+int AgglHierClusterer::outputCollapsedLeaf(FILE *out_file,
+        const ClusterNode &leaf_node,
+        int next_label) {
+    const std::vector<std::string> &names =
+            duplicate_names_[leaf_node.getLabel()];
+    int duplicate_num = names.size();
+    // sample j gets label next_label + j, the representative is sample 0;
+    // merge t joins sample t + 1, the last merge is the leaf node itself
+    int merge_label_begin = next_label + duplicate_num + 1;
+    for (int t = duplicate_num - 1; t >= 0; --t) {
+        int merge_label = t == duplicate_num - 1 ?
+                leaf_node.getLabel() : merge_label_begin + t;
+        int left_label = t == 0 ? next_label : merge_label_begin + t - 1;
+        fprintf(out_file,
+                "%d\tNOT_LEAF_NODE\t%d\t%d\t%f\n",
+                merge_label,
+                left_label,
+                next_label + t + 1,
+                0.0);
+    }
+    for (int j = 0; j <= duplicate_num; ++j) {
+        fprintf(out_file,
+                "%d\t%s\t%d\t%d\t%f\n",
+                next_label + j,
+                j == 0 ? leaf_node.getClusterName().c_str()
+                        : names[j - 1].c_str(),
+                -1,
+                -1,
+                0.0);
+    }
+    return merge_label_begin + duplicate_num - 1;
+}
+
 /*
 * Output the whole agglomerative tree to a file.
 */
@@ -342,8 +1624,14 @@ bool AgglHierClusterer::output(const std::string &file_name) {
             "ClusterLabel\tClusterName\tLeftChildLabel\tRightChildLabel\tDistance\n"); // NOLINT
     // just output the nodes and its child from end of the cluster node array to
     // begin
+    int expanded_label = node_num_;  // labels of expanded duplicate samples
     for (int i = node_num_ - 1; i >=0; -- i) {
         ClusterNode & cur_node = cluster_node_array_[i];
+        if (isCollapsedLeaf(cur_node)) {
+            expanded_label = outputCollapsedLeaf(out_file, cur_node,
+                    expanded_label);
+            continue;
+        }
         std::string cluster_name = cur_node.getClusterName();
         if (cur_node.getLeftChildLabel() >= 0
                 && cur_node.getRightChildLabel() >= 0) {
@@ -375,21 +1663,21 @@ bool AgglHierClusterer::output(const std::string &file_name,
     }
     fprintf(out_file, "ClusterSize\tClusterNodes[1,2,3...]\n");
     std::queue<int> cluster_nodes_queue;
-    cluster_nodes_queue.push(node_num_ - 1);
+    cluster_nodes_queue.push(findRootLabel());
     int cur_label = -1;
     while (! cluster_nodes_queue.empty()) {
         cur_label = cluster_nodes_queue.front();
         cluster_nodes_queue.pop();
 
-        assert(cur_label > 0 && cur_label < node_num_);
+        assert(cur_label >= 0 && cur_label < node_num_);
 
         ClusterNode& cur_cluster_node = cluster_node_array_[cur_label];
         if (cur_cluster_node.getLeftChildLabel() < 0 &&
                 cur_cluster_node.getRightChildLabel() < 0) {
             // leaf nodes
-            fprintf(out_file,
-                    "1\t%s\n",
-                    cur_cluster_node.getClusterName().c_str());
+            fprintf(out_file, "%d", cur_cluster_node.getBasicNodeNum());
+            outputLeafNames(out_file, cur_cluster_node);
+            fprintf(out_file, "\n");
         } else if (cur_cluster_node.getDistance() > distance_threshold) {
             cluster_nodes_queue.push(cur_cluster_node.getLeftChildLabel());
             cluster_nodes_queue.push(cur_cluster_node.getRightChildLabel());
@@ -412,12 +1700,10 @@ bool AgglHierClusterer::output(const std::string &file_name,
                     out_queue.push(cur_out_node.getRightChildLabel());
                 }
             }
-            fprintf(out_file, "%lu", out_labels.size());
+            fprintf(out_file, "%d", cur_cluster_node.getBasicNodeNum());
             for (std::vector<int>::const_iterator it = out_labels.begin();
                     it != out_labels.end(); ++ it) {
-                fprintf(out_file,
-                        "\t%s",
-                        cluster_node_array_[(*it)].getClusterName().c_str());
+                outputLeafNames(out_file, cluster_node_array_[(*it)]);
             }
             fprintf(out_file, "\n");
         }
@@ -426,5 +1712,584 @@ bool AgglHierClusterer::output(const std::string &file_name,
     return true;
 }
 
-}  // namespace cluster
+int AgglHierClusterer::findRootLabel() const {
+    std::vector<char> is_child(node_num_, 0);
+    for (int i = 0; i < node_num_; ++i) {
+        if (cluster_node_array_[i].getLeftChildLabel() >= 0) {
+            is_child[cluster_node_array_[i].getLeftChildLabel()] = 1;
+        }
+        if (cluster_node_array_[i].getRightChildLabel() >= 0) {
+            is_child[cluster_node_array_[i].getRightChildLabel()] = 1;
+        }
+    }
+    for (int i = node_num_ - 1; i >= 0; --i) {
+        if (!is_child[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static const char persistMagic[8] = {'N', 'N', 'C', 'H', 'C', 'L', 'U', 'S'};
+static const int persistVersion = 1;
+
+/*
+* File format: magic, version, linkage, base node num, sample num, node num,
+* duplicate epsilon, the nodes and then the names of collapsed duplicates.
+* Numbers are stored in the byte order of the machine.
+*/
+bool AgglHierClusterer::save(const std::string &file_name) const {
+    if (node_num_ == 0 || node_num_ != (base_node_num_ << 1) - 1) {
+        fprintf(stderr, "Only a clustered tree can be saved!\n");
+        return false;
+    }
+    FILE *out_file = NULL;
+    if ((out_file = fopen(file_name.c_str(), "wb")) == NULL) {
+        fprintf(stderr, "Open file: %s failed!\n", file_name.c_str());
+        return false;
+    }
+    bool success = fwrite(persistMagic, sizeof(persistMagic), 1, out_file) == 1
+            && writeValue(out_file, persistVersion)
+            && writeValue(out_file, (int)distance_calculator_type_)
+            && writeValue(out_file, base_node_num_)
+            && writeValue(out_file, sample_num_)
+            && writeValue(out_file, node_num_)
+            && writeValue(out_file, duplicate_epsilon_);
+    for (int i = 0; success && i < node_num_; ++i) {
+        const ClusterNode &node = cluster_node_array_[i];
+        success = writeValue(out_file, node.getLabel())
+                && writeValue(out_file, node.getLeftChildLabel())
+                && writeValue(out_file, node.getRightChildLabel())
+                && writeValue(out_file, node.getBasicNodeNum())
+                && writeValue(out_file, node.getDistance())
+                && writeString(out_file, node.getClusterName());
+    }
+    int collapsed_leaf_num = 0;
+    for (size_t i = 0; i < duplicate_names_.size(); ++i) {
+        collapsed_leaf_num += duplicate_names_[i].empty() ? 0 : 1;
+    }
+    success = success && writeValue(out_file, collapsed_leaf_num);
+    for (size_t i = 0; success && i < duplicate_names_.size(); ++i) {
+        if (duplicate_names_[i].empty()) {
+            continue;
+        }
+        success = writeValue(out_file, (int)i)
+                && writeValue(out_file, (int)duplicate_names_[i].size());
+        for (size_t j = 0; success && j < duplicate_names_[i].size(); ++j) {
+            success = writeString(out_file, duplicate_names_[i][j]);
+        }
+    }
+    success = fclose(out_file) == 0 && success;
+    if (!success) {
+        fprintf(stderr, "Write tree to %s failed!\n", file_name.c_str());
+    }
+    return success;
+}
+
+/*
+* Check that nodes form one binary tree with leaf_num leaves, in which the
+* sample count of every inner node is the sum of its children's. Children may
+* come after their parent, as insert() links new merges into the tree.
+*/
+static bool isValidTree(const std::vector<ClusterNode> &nodes, int leaf_num) {
+    std::vector<int> parent_labels(nodes.size(), -1);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        int children[2] = {nodes[i].getLeftChildLabel(),
+                nodes[i].getRightChildLabel()};
+        for (int j = 0; j < 2; ++j) {
+            if (children[j] < 0) {
+                continue;
+            }
+            if (parent_labels[children[j]] >= 0 || children[j] == (int)i) {
+                return false;
+            }
+            parent_labels[children[j]] = i;
+        }
+    }
+    int root_label = -1;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (parent_labels[i] < 0) {
+            if (root_label >= 0) {
+                return false;
+            }
+            root_label = i;
+        }
+    }
+    if (root_label < 0) {
+        return false;
+    }
+    // pre-order from the root, every node must be reached once
+    std::vector<int> order;
+    order.reserve(nodes.size());
+    order.push_back(root_label);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const ClusterNode &node = nodes[order[i]];
+        if (node.getLeftChildLabel() >= 0) {
+            order.push_back(node.getLeftChildLabel());
+            order.push_back(node.getRightChildLabel());
+        }
+    }
+    if (order.size() != nodes.size()) {
+        return false;
+    }
+    int found_leaf_num = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const ClusterNode &node = nodes[i];
+        if (node.getLeftChildLabel() < 0) {
+            found_leaf_num++;
+        } else if (node.getBasicNodeNum()
+                != nodes[node.getLeftChildLabel()].getBasicNodeNum()
+                + nodes[node.getRightChildLabel()].getBasicNodeNum()) {
+            return false;
+        }
+    }
+    return found_leaf_num == leaf_num;
+}
 
+/*
+* The file is read into local state and checked as a whole, the clusterer is
+* only changed when all of it is valid.
+*/
+bool AgglHierClusterer::load(const std::string &file_name) {
+    FILE *in_file = NULL;
+    if ((in_file = fopen(file_name.c_str(), "rb")) == NULL) {
+        fprintf(stderr, "Open file: %s failed!\n", file_name.c_str());
+        return false;
+    }
+    char magic[sizeof(persistMagic)] = {0};
+    int version = 0;
+    int type = 0;
+    int base_node_num = 0;
+    int sample_num = 0;
+    int node_num = 0;
+    float duplicate_epsilon = -1.0;
+    bool success = fread(magic, sizeof(magic), 1, in_file) == 1
+            && memcmp(magic, persistMagic, sizeof(magic)) == 0
+            && readValue(in_file, &version)
+            && version == persistVersion
+            && readValue(in_file, &type)
+            && readValue(in_file, &base_node_num)
+            && readValue(in_file, &sample_num)
+            && readValue(in_file, &node_num)
+            && readValue(in_file, &duplicate_epsilon)
+            && base_node_num > 0
+            && sample_num >= base_node_num
+            && node_num == (base_node_num << 1) - 1;
+    const DistanceCalculator *distance_calculator = success ?
+            DistanceCalculatorFactory::createCalculator(
+                    (DistanceCalculatorType::Type)type) : NULL;
+    success = distance_calculator != NULL;
+
+    std::vector<ClusterNode> nodes;
+    std::map<std::string, int> node_name_map;
+    for (int i = 0; success && i < node_num; ++i) {
+        int label = -1;
+        int left_child_label = -1;
+        int right_child_label = -1;
+        int basic_node_num = 0;
+        float distance = 0.0;
+        std::string name;
+        success = readValue(in_file, &label)
+                && readValue(in_file, &left_child_label)
+                && readValue(in_file, &right_child_label)
+                && readValue(in_file, &basic_node_num)
+                && readValue(in_file, &distance)
+                && readString(in_file, &name)
+                && label == i
+                && left_child_label >= -1 && left_child_label < node_num
+                && right_child_label >= -1 && right_child_label < node_num
+                && (left_child_label < 0) == (right_child_label < 0)
+                && basic_node_num >= 1;
+        if (success && left_child_label < 0) {
+            success = node_name_map.insert(std::make_pair(name, label)).second;
+        }
+        nodes.push_back(ClusterNode(label, left_child_label,
+                right_child_label, basic_node_num, -1, distance, name));
+    }
+    success = success && isValidTree(nodes, base_node_num);
+
+    std::vector<std::vector<std::string> > duplicate_names;
+    int collapsed_leaf_num = 0;
+    int duplicate_sample_num = 0;
+    success = success && readValue(in_file, &collapsed_leaf_num)
+            && collapsed_leaf_num >= 0 && collapsed_leaf_num <= base_node_num;
+    for (int i = 0; success && i < collapsed_leaf_num; ++i) {
+        int label = -1;
+        int duplicate_num = 0;
+        success = readValue(in_file, &label)
+                && readValue(in_file, &duplicate_num)
+                && label >= 0 && label < node_num
+                && nodes[label].getLeftChildLabel() < 0
+                && duplicate_names.size() <= (size_t)label
+                && duplicate_num == nodes[label].getBasicNodeNum() - 1;
+        if (success && (int)duplicate_names.size() <= label) {
+            duplicate_names.resize(label + 1);
+        }
+        for (int j = 0; success && j < duplicate_num; ++j) {
+            std::string name;
+            success = readString(in_file, &name)
+                    && node_name_map.insert(std::make_pair(name, label)).second;
+            if (success) {
+                duplicate_names[label].push_back(name);
+            }
+        }
+        duplicate_sample_num += duplicate_num;
+    }
+    int leaf_sample_num = 0;
+    for (size_t i = 0; success && i < nodes.size(); ++i) {
+        if (nodes[i].getLeftChildLabel() < 0) {
+            leaf_sample_num += nodes[i].getBasicNodeNum();
+        }
+    }
+    success = success && base_node_num + duplicate_sample_num == sample_num
+            && leaf_sample_num == sample_num;
+    fclose(in_file);
+    if (!success) {
+        delete distance_calculator;
+        fprintf(stderr, "Read tree from %s failed!\n", file_name.c_str());
+        return false;
+    }
+
+    releaseDistanceMatrix();
+    node_num_ = 0;
+    if (!reserveClusterNodes(node_num)) {
+        delete distance_calculator;
+        return false;
+    }
+    delete distance_calculator_;
+    distance_calculator_ = distance_calculator;
+    distance_calculator_type_ = (DistanceCalculatorType::Type)type;
+    std::copy(nodes.begin(), nodes.end(), cluster_node_array_);
+    node_name_map_.swap(node_name_map);
+    duplicate_names_.swap(duplicate_names);
+    base_node_num_ = base_node_num;
+    sample_num_ = sample_num;
+    duplicate_epsilon_ = duplicate_epsilon;
+    node_num_ = node_num;
+    fprintf(stderr, "Load tree of %d samples success!\n", sample_num_);
+    return true;
+}
+
+/*
+* Pearson correlation between the distances of the sample to the leaves and
+* the distances where the sample meets the leaves in the tree
+*/
+float AgglHierClusterer::getCopheneticCorrelation(int sample_label,
+        int target_label,
+        const std::vector<int> &parent_labels,
+        const std::vector<float> &leaf_distances) const {
+    double pair_num = 0.0;
+    double sum_x = 0.0;
+    double sum_y = 0.0;
+    double sum_xx = 0.0;
+    double sum_yy = 0.0;
+    double sum_xy = 0.0;
+    std::vector<int> leaves;
+    if (sample_label == target_label) {
+        // the sample is a duplicate in this leaf
+        leaves.push_back(sample_label);
+    }
+    float cophenetic_distance = 0.0;
+    for (int cur_label = sample_label; true;
+            cur_label = parent_labels[cur_label]) {
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            double x = leaf_distances[leaves[i]];
+            double y = cophenetic_distance;
+            pair_num += 1.0;
+            sum_x += x;
+            sum_y += y;
+            sum_xx += x * x;
+            sum_yy += y * y;
+            sum_xy += x * y;
+        }
+        leaves.clear();
+        int parent_label = parent_labels[cur_label];
+        if (parent_label < 0) {
+            break;
+        }
+        // all the leaves of the sibling meet the sample at the parent
+        const ClusterNode &parent_node = cluster_node_array_[parent_label];
+        cophenetic_distance = parent_node.getDistance();
+        std::stack<int> sibling_nodes;
+        sibling_nodes.push(parent_node.getLeftChildLabel() == cur_label ?
+                parent_node.getRightChildLabel() :
+                parent_node.getLeftChildLabel());
+        while (!sibling_nodes.empty()) {
+            const ClusterNode &node = cluster_node_array_[sibling_nodes.top()];
+            sibling_nodes.pop();
+            if (node.getLeftChildLabel() < 0) {
+                leaves.push_back(node.getLabel());
+            } else {
+                sibling_nodes.push(node.getLeftChildLabel());
+                sibling_nodes.push(node.getRightChildLabel());
+            }
+        }
+    }
+    double var_x = pair_num * sum_xx - sum_x * sum_x;
+    double var_y = pair_num * sum_yy - sum_y * sum_y;
+    if (var_x <= 0.0 || var_y <= 0.0) {
+        return 1.0;
+    }
+    return (pair_num * sum_xy - sum_x * sum_y) / sqrt(var_x * var_y);
+}
+
+bool AgglHierClusterer::insert(const std::string &sample_name,
+        const std::vector<float> &leaf_distances,
+        float *quality) {
+    if (node_num_ == 0 || node_num_ != (base_node_num_ << 1) - 1) {
+        fprintf(stderr, "Only a clustered tree can be inserted into!\n");
+        return false;
+    }
+    if (node_name_map_.find(sample_name) != node_name_map_.end()) {
+        fprintf(stderr, "Sample %s is already in the tree!\n",
+                sample_name.c_str());
+        return false;
+    }
+    if (leaf_distances.size() < (size_t)node_num_) {
+        fprintf(stderr, "Distances of %s to the leaves are missing!\n",
+                sample_name.c_str());
+        return false;
+    }
+    if (leaf_distances.size() > (size_t)node_num_) {
+        fprintf(stderr, "More distances than nodes are given for %s!\n",
+                sample_name.c_str());
+        return false;
+    }
+
+    // pre-order from the root, so the reversed order has children first
+    std::vector<int> order;
+    std::vector<int> parent_labels(node_num_, -1);
+    order.reserve(node_num_);
+    std::stack<int> pending_nodes;
+    pending_nodes.push(findRootLabel());
+    while (!pending_nodes.empty()) {
+        int label = pending_nodes.top();
+        pending_nodes.pop();
+        order.push_back(label);
+        const ClusterNode &node = cluster_node_array_[label];
+        if (node.getLeftChildLabel() >= 0) {
+            parent_labels[node.getLeftChildLabel()] = label;
+            parent_labels[node.getRightChildLabel()] = label;
+            pending_nodes.push(node.getLeftChildLabel());
+            pending_nodes.push(node.getRightChildLabel());
+        }
+    }
+
+    // linkage distance between the sample and every node
+    std::vector<float> node_distances(node_num_, 0.0);
+    for (int i = node_num_ - 1; i >= 0; --i) {
+        const ClusterNode &node = cluster_node_array_[order[i]];
+        if (node.getLeftChildLabel() < 0) {
+            if (leaf_distances[node.getLabel()] < 0.0) {
+                fprintf(stderr, "Distance between %s and %s is missing!\n",
+                        sample_name.c_str(), node.getClusterName().c_str());
+                return false;
+            }
+            node_distances[node.getLabel()] =
+                    distance_calculator_->weightedDistance(1,
+                            node.getBasicNodeNum(),
+                            leaf_distances[node.getLabel()]);
+        } else {
+            const ClusterNode &left_node =
+                    cluster_node_array_[node.getLeftChildLabel()];
+            const ClusterNode &right_node =
+                    cluster_node_array_[node.getRightChildLabel()];
+            node_distances[node.getLabel()] = (*distance_calculator_)(
+                    left_node.getBasicNodeNum(),
+                    right_node.getBasicNodeNum(),
+                    1,
+                    node_distances[left_node.getLabel()],
+                    node_distances[right_node.getLabel()],
+                    node.getDistance());
+        }
+    }
+
+    // the closest node the sample can merge with below its parent
+    int target_label = -1;
+    for (int i = 0; i < node_num_; ++i) {
+        int parent_label = parent_labels[i];
+        if (parent_label >= 0 && node_distances[i]
+                > cluster_node_array_[parent_label].getDistance()) {
+            continue;
+        }
+        if (target_label < 0
+                || node_distances[i] < node_distances[target_label]) {
+            target_label = i;
+        }
+    }
+    assert(target_label >= 0);
+
+    int sample_label = -1;
+    if (duplicate_epsilon_ >= 0.0
+            && cluster_node_array_[target_label].getLeftChildLabel() < 0
+            && leaf_distances[target_label] <= duplicate_epsilon_) {
+        // a duplicate of the leaf
+        if ((int)duplicate_names_.size() <= target_label) {
+            duplicate_names_.resize(target_label + 1);
+        }
+        duplicate_names_[target_label].push_back(sample_name);
+        sample_label = target_label;
+        cluster_node_array_[sample_label].setBasicNodeNum(
+                cluster_node_array_[sample_label].getBasicNodeNum() + 1);
+    } else {
+        if (node_num_ + 2 > cluster_node_capacity_
+                && !reserveClusterNodes((cluster_node_capacity_ << 1) + 2)) {
+            return false;
+        }
+        sample_label = node_num_;
+        int merge_label = node_num_ + 1;
+        const ClusterNode &target_node = cluster_node_array_[target_label];
+        cluster_node_array_[sample_label] =
+                ClusterNode(sample_label, -1, -1, 1, -1, 0.0, sample_name);
+        cluster_node_array_[merge_label] = ClusterNode(merge_label,
+                target_label,
+                sample_label,
+                target_node.getBasicNodeNum() + 1,
+                -1,
+                std::max(node_distances[target_label],
+                        target_node.getDistance()));
+        int parent_label = parent_labels[target_label];
+        if (parent_label >= 0) {
+            ClusterNode &parent_node = cluster_node_array_[parent_label];
+            if (parent_node.getLeftChildLabel() == target_label) {
+                parent_node.setLeftChildLabel(merge_label);
+            } else {
+                parent_node.setRightChildLabel(merge_label);
+            }
+        }
+        parent_labels.push_back(merge_label);
+        parent_labels.push_back(parent_label);
+        parent_labels[target_label] = merge_label;
+        node_num_ += 2;
+        base_node_num_++;
+    }
+    // the ancestors above the new merge contain one more sample
+    int ancestor_label = parent_labels[sample_label];
+    if (sample_label != target_label) {
+        ancestor_label = parent_labels[ancestor_label];
+    }
+    for (; ancestor_label >= 0; ancestor_label = parent_labels[ancestor_label]) {  // NOLINT
+        cluster_node_array_[ancestor_label].setBasicNodeNum(
+                cluster_node_array_[ancestor_label].getBasicNodeNum() + 1);
+    }
+    node_name_map_[sample_name] = sample_label;
+    sample_num_++;
+
+    if (quality != NULL) {
+        *quality = getCopheneticCorrelation(sample_label, target_label,
+                parent_labels, leaf_distances);
+    }
+    return true;
+}
+
+bool AgglHierClusterer::insert(const std::string &distance_file_path) {
+    if (node_num_ == 0 || node_num_ != (base_node_num_ << 1) - 1) {
+        fprintf(stderr, "Only a clustered tree can be inserted into!\n");
+        return false;
+    }
+    LineReader distance_file;
+    if (!distance_file.open(distance_file_path)) {
+        return false;
+    }
+    // distances to the existing leaves are kept by leaf index
+    std::vector<int> leaf_labels;
+    std::vector<int> leaf_index(node_num_, -1);
+    for (int i = 0; i < node_num_; ++i) {
+        if (cluster_node_array_[i].getLeftChildLabel() < 0) {
+            leaf_index[i] = leaf_labels.size();
+            leaf_labels.push_back(i);
+        }
+    }
+    std::map<std::string, int> new_sample_map;
+    std::vector<std::string> new_sample_names;
+    std::vector<std::vector<float> > new_sample_distances;
+    std::map<std::pair<int, int>, float> new_pair_distances;
+
+    std::string line;
+    std::string names[2];
+    float distance = 0.0;
+    while (distance_file.readLine(&line)) {
+        if (!parseDistanceLine(line, &names[0], &names[1], &distance)) {
+            continue;
+        }
+        int labels[2] = {-1, -1};
+        int new_indexes[2] = {-1, -1};
+        for (int k = 0; k < 2; ++k) {
+            std::map<std::string, int>::const_iterator it =
+                    node_name_map_.find(names[k]);
+            if (it != node_name_map_.end()) {
+                labels[k] = it->second;
+                continue;
+            }
+            it = new_sample_map.find(names[k]);
+            if (it != new_sample_map.end()) {
+                new_indexes[k] = it->second;
+                continue;
+            }
+            new_indexes[k] = new_sample_names.size();
+            new_sample_map.insert(
+                    std::pair<std::string, int>(names[k], new_indexes[k]));
+            new_sample_names.push_back(names[k]);
+            new_sample_distances.push_back(
+                    std::vector<float>(leaf_labels.size(), -1.0));
+        }
+        if (new_indexes[0] >= 0 && new_indexes[1] >= 0) {
+            if (new_indexes[0] != new_indexes[1]) {
+                new_pair_distances[std::make_pair(
+                        std::min(new_indexes[0], new_indexes[1]),
+                        std::max(new_indexes[0], new_indexes[1]))] = distance;
+            }
+        } else if (new_indexes[0] >= 0) {
+            new_sample_distances[new_indexes[0]][leaf_index[labels[1]]] =
+                    distance;
+        } else if (new_indexes[1] >= 0) {
+            new_sample_distances[new_indexes[1]][leaf_index[labels[0]]] =
+                    distance;
+        }
+    }
+    distance_file.reportThroughput();
+    if (distance_file.isFailed()) {
+        fprintf(stderr, "Read distance file %s failed!\n",
+                distance_file_path.c_str());
+        return false;
+    }
+
+    std::vector<int> new_sample_labels(new_sample_names.size(), -1);
+    double quality_sum = 0.0;
+    for (size_t j = 0; j < new_sample_names.size(); ++j) {
+        std::vector<float> leaf_distances(node_num_, -1.0);
+        for (size_t i = 0; i < leaf_labels.size(); ++i) {
+            leaf_distances[leaf_labels[i]] = new_sample_distances[j][i];
+        }
+        for (size_t i = 0; i < j; ++i) {
+            int label = new_sample_labels[i];
+            if (cluster_node_array_[label].getClusterName()
+                    != new_sample_names[i]) {
+                continue;  // a duplicate of another leaf
+            }
+            std::map<std::pair<int, int>, float>::const_iterator it =
+                    new_pair_distances.find(std::make_pair((int)i, (int)j));
+            if (it == new_pair_distances.end()) {
+                fprintf(stderr, "Distance between %s and %s is missing!\n",
+                        new_sample_names[i].c_str(),
+                        new_sample_names[j].c_str());
+                return false;
+            }
+            leaf_distances[label] = it->second;
+        }
+        float quality = 0.0;
+        if (!insert(new_sample_names[j], leaf_distances, &quality)) {
+            return false;
+        }
+        new_sample_labels[j] = node_name_map_[new_sample_names[j]];
+        quality_sum += quality;
+        std::vector<float>().swap(new_sample_distances[j]);
+    }
+    fprintf(stderr, "Insert %lu samples success! Mean cophenetic correlation"
+            " of the inserted samples: %f\n", new_sample_names.size(),
+            new_sample_names.empty() ?
+                    1.0 : quality_sum / new_sample_names.size());
+    return true;
+}
+
+}  // namespace cluster
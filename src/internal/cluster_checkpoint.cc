@@ -0,0 +1,125 @@
+//
+// Checkpoints of a running doCluster().
+//
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "binary_io.h"
+#include "cluster_checkpoint.h"
+
+namespace cluster {
+
+static const char checkpointMagic[8] = {'N', 'N', 'C', 'H', 'C', 'K', 'P', 'T'};
+static const int checkpointVersion = 2;
+
+bool ClusterCheckpoint::write(const std::string &file_name) const {
+    std::string tmp_file_name = file_name + ".tmp";
+    FILE *out_file = NULL;
+    if ((out_file = fopen(tmp_file_name.c_str(), "wb")) == NULL) {
+        fprintf(stderr, "Open file: %s failed!\n", tmp_file_name.c_str());
+        return false;
+    }
+    bool success =
+            fwrite(checkpointMagic, sizeof(checkpointMagic), 1, out_file) == 1
+            && writeValue(out_file, checkpointVersion)
+            && writeValue(out_file, linkage_type)
+            && writeValue(out_file, base_node_num)
+            && writeValue(out_file, sample_num)
+            && writeValue(out_file, duplicate_epsilon)
+            && writeString(out_file, input_identity)
+            && writeValue(out_file, (int)merges.size());
+    for (size_t i = 0; success && i < merges.size(); ++i) {
+        success = writeValue(out_file, merges[i].getLeftChildLabel())
+                && writeValue(out_file, merges[i].getRightChildLabel())
+                && writeValue(out_file, merges[i].getDistance());
+    }
+    success = success
+            && writeValue(out_file, (int)chain.size())
+            && (chain.empty() || fwrite(&chain[0], sizeof(int),
+                    chain.size(), out_file) == chain.size())
+            && writeValue(out_file, nearest_neighbor_label)
+            && writeValue(out_file, nearest_distance);
+    success = fclose(out_file) == 0 && success;
+    if (!success || rename(tmp_file_name.c_str(), file_name.c_str()) != 0) {
+        fprintf(stderr, "Write checkpoint to %s failed!\n", file_name.c_str());
+        remove(tmp_file_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ClusterCheckpoint::read(const std::string &file_name) {
+    FILE *in_file = NULL;
+    if ((in_file = fopen(file_name.c_str(), "rb")) == NULL) {
+        return false;
+    }
+    char magic[sizeof(checkpointMagic)] = {0};
+    int version = 0;
+    int merge_num = 0;
+    bool success = fread(magic, sizeof(magic), 1, in_file) == 1
+            && memcmp(magic, checkpointMagic, sizeof(magic)) == 0
+            && readValue(in_file, &version)
+            && version == checkpointVersion
+            && readValue(in_file, &linkage_type)
+            && readValue(in_file, &base_node_num)
+            && readValue(in_file, &sample_num)
+            && readValue(in_file, &duplicate_epsilon)
+            && readString(in_file, &input_identity)
+            && readValue(in_file, &merge_num)
+            && merge_num >= 0 && merge_num < base_node_num;
+    merges.clear();
+    for (int i = 0; success && i < merge_num; ++i) {
+        int left_child_label = -1;
+        int right_child_label = -1;
+        float distance = 0.0;
+        success = readValue(in_file, &left_child_label)
+                && readValue(in_file, &right_child_label)
+                && readValue(in_file, &distance);
+        merges.push_back(ClusterNode(base_node_num + i, left_child_label,
+                right_child_label, 0, -1, distance));
+    }
+    int size = 0;
+    success = success && readValue(in_file, &size)
+            && size > 0 && size <= base_node_num + merge_num;
+    if (success) {
+        chain.resize(size);
+        success = fread(&chain[0], sizeof(int), size, in_file)
+                == (size_t)size;
+    }
+    success = success
+            && readValue(in_file, &nearest_neighbor_label)
+            && readValue(in_file, &nearest_distance);
+    fclose(in_file);
+    if (!success) {
+        fprintf(stderr, "Read checkpoint from %s failed!\n",
+                file_name.c_str());
+    }
+    return success;
+}
+
+void CheckpointWriter::run(CheckpointWriter *writer,
+        ClusterCheckpoint *checkpoint) {
+    if (checkpoint->write(writer->file_name_)) {
+        fprintf(stderr, "Checkpoint of %lu merges written to %s\n",
+                checkpoint->merges.size(), writer->file_name_.c_str());
+    }
+    delete checkpoint;
+    writer->busy_ = false;
+}
+
+void CheckpointWriter::write(ClusterCheckpoint *checkpoint) {
+    assert(!busy_);
+    wait();
+    busy_ = true;
+    thread_ = std::thread(run, this, checkpoint);
+}
+
+void CheckpointWriter::wait() {
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+}  // namespace cluster
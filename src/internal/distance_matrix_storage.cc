@@ -0,0 +1,289 @@
+//
+// Storage of the packed distance matrix.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "distance_matrix_storage.h"
+
+namespace cluster {
+
+static int shared_memory_counter = 0;
+
+/*
+* Create an anonymous shared memory object of byte_size bytes. The name is
+* unlinked at once, only the returned descriptor keeps the object alive.
+*/
+static int createSharedMemory(size_t byte_size) {
+    char name[32] = {0};
+    snprintf(name, sizeof(name), "/nnchclus.%d.%d",
+            static_cast<int>(getpid()),
+            __sync_fetch_and_add(&shared_memory_counter, 1));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "Create shared memory %s failed!\n", name);
+        return -1;
+    }
+    shm_unlink(name);
+    if (ftruncate(fd, byte_size) != 0) {
+        fprintf(stderr, "Resize shared memory to %lu bytes failed!\n",
+                byte_size);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+* One process_madvise() call for the whole batch of ranges, or one madvise()
+* per range when the kernel has no process_madvise() (before Linux 5.10).
+*/
+void DistanceMatrixStorage::adviseWillNeed(const struct iovec *ranges,
+        size_t range_num) const {
+#if defined(SYS_process_madvise) && defined(SYS_pidfd_open)
+    if (pidfd_ == -1) {
+        pidfd_ = static_cast<int>(syscall(SYS_pidfd_open, getpid(), 0));
+        if (pidfd_ < 0) {
+            pidfd_ = -2;
+        }
+    }
+    if (pidfd_ >= 0) {
+        if (syscall(SYS_process_madvise, pidfd_, ranges, range_num,
+                MADV_WILLNEED, 0) >= 0) {
+            return;
+        }
+        if (errno == ENOSYS || errno == EINVAL || errno == EPERM) {
+            close(pidfd_);
+            pidfd_ = -2;
+        }
+    }
+#endif
+    for (size_t i = 0; i < range_num; ++i) {
+        madvise(ranges[i].iov_base, ranges[i].iov_len, MADV_WILLNEED);
+    }
+}
+
+bool DistanceMatrixStorage::allocate(size_t float_num,
+        DistanceMatrixStorageType::Type type) {
+    release();
+    if (float_num == 0) {
+        // a single node has no pairs, mapping 0 bytes would fail
+        type_ = type;
+        return true;
+    }
+    size_t byte_size = float_num * sizeof(float);
+    switch (type) {
+        case DistanceMatrixStorageType::HEAP:
+            data_ = new(std::nothrow) float[float_num];
+            if (data_ == NULL) {
+                fprintf(stderr, "Allocate %lu bytes for distance matrix"
+                        " failed!\n", byte_size);
+                return false;
+            }
+            break;
+        case DistanceMatrixStorageType::SHARED_MEMORY: {
+            fd_ = createSharedMemory(byte_size);
+            if (fd_ < 0) {
+                return false;
+            }
+            void *addr = mmap(NULL, byte_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd_, 0);
+            if (addr == MAP_FAILED) {
+                fprintf(stderr, "Map %lu bytes of shared memory failed!\n",
+                        byte_size);
+                close(fd_);
+                fd_ = -1;
+                return false;
+            }
+            data_ = static_cast<float *>(addr);
+            break;
+        }
+        default:
+            fprintf(stderr, "Storage type %d can not be allocated!\n", type);
+            return false;
+    }
+    float_num_ = float_num;
+    type_ = type;
+    return true;
+}
+
+bool DistanceMatrixStorage::copyFrom(const DistanceMatrixStorage &base) {
+    if (base.getData() == NULL && base.getFloatNum() != 0) {
+        return false;
+    }
+    if (!allocate(base.getFloatNum(), DistanceMatrixStorageType::HEAP)) {
+        return false;
+    }
+    if (float_num_ != 0) {
+        memcpy(data_, base.getData(), base.getByteSize());
+    }
+    return true;
+}
+
+bool DistanceMatrixStorage::mapFile(const std::string &path,
+        size_t float_num) {
+    release();
+    size_t byte_size = float_num * sizeof(float);
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd_ < 0) {
+        if (errno == EEXIST) {
+            fprintf(stderr, "Matrix file %s exists, will not overwrite it!\n",
+                    path.c_str());
+        } else {
+            fprintf(stderr, "Create matrix file %s failed!\n", path.c_str());
+        }
+        return false;
+    }
+    unlink(path.c_str());
+    if (float_num == 0) {
+        type_ = DistanceMatrixStorageType::FILE_MAPPING;
+        return true;
+    }
+    if (ftruncate(fd_, byte_size) != 0) {
+        fprintf(stderr, "Resize matrix file %s to %lu bytes failed!\n",
+                path.c_str(), byte_size);
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    void *addr = mmap(NULL, byte_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Map %lu bytes of matrix file %s failed!\n",
+                byte_size, path.c_str());
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    // the kernel read-ahead only pulls useless pages around the scattered
+    // column reads, the row reads are prefetched explicitly
+    madvise(addr, byte_size, MADV_RANDOM);
+    data_ = static_cast<float *>(addr);
+    float_num_ = float_num;
+    type_ = DistanceMatrixStorageType::FILE_MAPPING;
+    return true;
+}
+
+bool DistanceMatrixStorage::copyToFile(const DistanceMatrixStorage &base,
+        const std::string &path) {
+    if (base.getType() != DistanceMatrixStorageType::FILE_MAPPING) {
+        fprintf(stderr, "Only file storage can be copied to a file!\n");
+        return false;
+    }
+    if (!mapFile(path, base.getFloatNum())) {
+        return false;
+    }
+    // the base is mapped shared, its file is up to date
+    size_t byte_size = getByteSize();
+    size_t copied = 0;
+#ifdef SYS_copy_file_range
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+    while (copied < byte_size) {
+        long ret = syscall(SYS_copy_file_range, base.fd_, &in_offset,
+                fd_, &out_offset, byte_size - copied, 0);
+        if (ret <= 0) {
+            break;
+        }
+        copied += ret;
+    }
+#endif
+    // file systems without copy_file_range() go through the mappings
+    if (copied < byte_size) {
+        memcpy(reinterpret_cast<char *>(data_) + copied,
+                reinterpret_cast<const char *>(base.getData()) + copied,
+                byte_size - copied);
+    }
+    return true;
+}
+
+void DistanceMatrixStorage::prefetch(
+        const std::vector<std::pair<size_t, size_t> > &ranges) const {
+    if (type_ != DistanceMatrixStorageType::FILE_MAPPING || ranges.empty()) {
+        return;
+    }
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    static const size_t batch_size = IOV_MAX;
+    struct iovec batch[batch_size];
+    size_t batch_num = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (ranges[i].second == 0) {
+            continue;
+        }
+        size_t begin_byte = ranges[i].first * sizeof(float);
+        size_t end_byte = begin_byte + ranges[i].second * sizeof(float);
+        begin_byte -= begin_byte % page_size;
+        batch[batch_num].iov_base = reinterpret_cast<char *>(data_)
+                + begin_byte;
+        batch[batch_num].iov_len = end_byte - begin_byte;
+        ++batch_num;
+        if (batch_num == batch_size) {
+            adviseWillNeed(batch, batch_num);
+            batch_num = 0;
+        }
+    }
+    if (batch_num > 0) {
+        adviseWillNeed(batch, batch_num);
+    }
+}
+
+bool DistanceMatrixStorage::mapPrivate(const DistanceMatrixStorage &base) {
+    release();
+    // the written pages of a private file mapping would be anonymous
+    // memory, so an out-of-core matrix is never mapped this way
+    if (base.getType() != DistanceMatrixStorageType::SHARED_MEMORY
+            || (base.fd_ < 0 && base.getFloatNum() != 0)) {
+        fprintf(stderr, "Only shared memory storage can be mapped"
+                " copy-on-write!\n");
+        return false;
+    }
+    if (base.getFloatNum() == 0) {
+        type_ = DistanceMatrixStorageType::PRIVATE_MAPPING;
+        return true;
+    }
+    void *addr = mmap(NULL, base.getByteSize(), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, base.fd_, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Map %lu bytes copy-on-write failed!\n",
+                base.getByteSize());
+        return false;
+    }
+    data_ = static_cast<float *>(addr);
+    float_num_ = base.getFloatNum();
+    type_ = DistanceMatrixStorageType::PRIVATE_MAPPING;
+    return true;
+}
+
+void DistanceMatrixStorage::release() {
+    if (data_ != NULL) {
+        if (type_ == DistanceMatrixStorageType::HEAP) {
+            delete[] data_;
+        } else {
+            munmap(data_, getByteSize());
+        }
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    if (pidfd_ >= 0) {
+        close(pidfd_);
+    }
+    pidfd_ = -1;
+    data_ = NULL;
+    float_num_ = 0;
+    fd_ = -1;
+    type_ = DistanceMatrixStorageType::HEAP;
+}
+
+}  // namespace cluster
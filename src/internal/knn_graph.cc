@@ -0,0 +1,186 @@
+//
+// Approximate k nearest neighbor graph of feature vectors.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "knn_graph.h"
+
+namespace cluster {
+
+// nodes are locked by stripes while their neighbor lists are updated
+static const int lockStripeNum = 1 << 12;
+
+// NN-descent stops when less than this fraction of the neighbors changed
+static const double convergeRatio = 0.001;
+
+bool KnnGraph::tryInsert(int node, int label, float distance) {
+    size_t begin = (size_t)node * k_;
+    int *labels = &neighbor_labels_[begin];
+    float *distances = &neighbor_distances_[begin];
+    char *is_new = &neighbor_is_new_[begin];
+    if (labels[k_ - 1] >= 0 && distance >= distances[k_ - 1]) {
+        return false;
+    }
+    for (int i = 0; i < k_ && labels[i] >= 0; ++i) {
+        if (labels[i] == label) {
+            return false;
+        }
+    }
+    // insert into the ascending list, dropping the farthest one
+    int pos = k_ - 1;
+    while (pos > 0 && (labels[pos - 1] < 0 || distances[pos - 1] > distance)) {
+        labels[pos] = labels[pos - 1];
+        distances[pos] = distances[pos - 1];
+        is_new[pos] = is_new[pos - 1];
+        --pos;
+    }
+    labels[pos] = label;
+    distances[pos] = distance;
+    is_new[pos] = 1;
+    return true;
+}
+
+/*
+* Every pair of the sampled new neighbors of a node, and every new neighbor
+* with every old one, are offered to each other's lists.
+*/
+void KnnGraph::localJoin(const std::vector<std::vector<int> > *new_lists,
+        const std::vector<std::vector<int> > *old_lists,
+        int begin,
+        int end,
+        std::vector<std::mutex> *locks,
+        const float *features,
+        int dimension,
+        std::atomic<long> *update_num) {
+    long local_update_num = 0;
+    for (int u = begin; u < end; ++u) {
+        const std::vector<int> &new_list = (*new_lists)[u];
+        const std::vector<int> &old_list = (*old_lists)[u];
+        for (size_t i = 0; i < new_list.size(); ++i) {
+            int v = new_list[i];
+            const float *v_features = features + (size_t)v * dimension;
+            for (size_t j = i + 1; j < new_list.size() + old_list.size();
+                    ++j) {
+                int w = j < new_list.size() ?
+                        new_list[j] : old_list[j - new_list.size()];
+                if (w == v) {
+                    continue;
+                }
+                float distance = KnnGraph::squaredDistance(v_features,
+                        features + (size_t)w * dimension, dimension);
+                {
+                    std::lock_guard<std::mutex> guard(
+                            (*locks)[v % lockStripeNum]);
+                    local_update_num += tryInsert(v, w, distance);
+                }
+                {
+                    std::lock_guard<std::mutex> guard(
+                            (*locks)[w % lockStripeNum]);
+                    local_update_num += tryInsert(w, v, distance);
+                }
+            }
+        }
+    }
+    *update_num += local_update_num;
+}
+
+bool KnnGraph::build(const float *features,
+        int node_num,
+        int dimension,
+        int k,
+        int thread_num,
+        int max_iteration) {
+    if (node_num < 2 || k <= 0 || dimension <= 0) {
+        fprintf(stderr, "Invalid knn graph: %d nodes, k %d, dimension %d\n",
+                node_num, k, dimension);
+        return false;
+    }
+    if (k > node_num - 1) {
+        k = node_num - 1;
+    }
+    node_num_ = node_num;
+    k_ = k;
+    neighbor_labels_.assign((size_t)node_num * k, -1);
+    neighbor_distances_.assign((size_t)node_num * k, 0.0);
+    neighbor_is_new_.assign((size_t)node_num * k, 0);
+    if (thread_num <= 0) {
+        thread_num = std::thread::hardware_concurrency();
+        thread_num = thread_num > 0 ? thread_num : 1;
+    }
+
+    // random initial neighbors
+    std::mt19937 random_engine(node_num);
+    std::uniform_int_distribution<int> random_label(0, node_num - 1);
+    for (int u = 0; u < node_num; ++u) {
+        const float *u_features = features + (size_t)u * dimension;
+        for (int tries = 0; tries < (k << 1)
+                && neighbor_labels_[(size_t)u * k + k - 1] < 0; ++tries) {
+            int v = random_label(random_engine);
+            if (v != u) {
+                tryInsert(u, v, squaredDistance(u_features,
+                        features + (size_t)v * dimension, dimension));
+            }
+        }
+    }
+
+    std::vector<std::mutex> locks(lockStripeNum);
+    std::vector<std::vector<int> > new_lists(node_num);
+    std::vector<std::vector<int> > old_lists(node_num);
+    // half of the new neighbors join in an iteration, the rest later
+    size_t sample_num = (k + 1) >> 1;
+    for (int iteration = 0; iteration < max_iteration; ++iteration) {
+        for (int u = 0; u < node_num; ++u) {
+            new_lists[u].clear();
+            old_lists[u].clear();
+        }
+        for (int u = 0; u < node_num; ++u) {
+            size_t begin = (size_t)u * k;
+            size_t sampled_num = 0;
+            for (int i = 0; i < k; ++i) {
+                int v = neighbor_labels_[begin + i];
+                if (v < 0) {
+                    break;
+                }
+                if (neighbor_is_new_[begin + i] && sampled_num < sample_num) {
+                    neighbor_is_new_[begin + i] = 0;
+                    ++sampled_num;
+                    new_lists[u].push_back(v);
+                    if (new_lists[v].size() < (sample_num << 1)) {
+                        new_lists[v].push_back(u);  // reverse neighbor
+                    }
+                } else if (!neighbor_is_new_[begin + i]) {
+                    old_lists[u].push_back(v);
+                    if (old_lists[v].size() < (sample_num << 1)) {
+                        old_lists[v].push_back(u);
+                    }
+                }
+            }
+        }
+
+        std::atomic<long> update_num(0);
+        std::vector<std::thread> threads;
+        int step = (node_num + thread_num - 1) / thread_num;
+        for (int begin = 0; begin < node_num; begin += step) {
+            threads.push_back(std::thread(&KnnGraph::localJoin, this,
+                    &new_lists, &old_lists, begin,
+                    std::min(begin + step, node_num), &locks, features,
+                    dimension, &update_num));
+        }
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+        fprintf(stderr, "NN-descent iteration %d: %ld updates\n",
+                iteration, (long)update_num);
+        if (update_num < convergeRatio * node_num * k) {
+            break;
+        }
+    }
+    return true;
+}
+
+}  // namespace cluster
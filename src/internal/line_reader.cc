@@ -0,0 +1,701 @@
+//
+// Pipelined line and block reader of plain, gzip and zstd files.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#ifdef NNCHCLUS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef NNCHCLUS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "line_reader.h"
+
+namespace cluster {
+
+static const size_t inputBlockSize = 1 << 20;  // bytes of one file read
+
+static const size_t outputChunkSize = 4 << 20;  // of sequential formats
+
+// BGZF members and zstd frames are grouped into jobs of this many
+// compressed bytes
+static const size_t jobInputSize = 1 << 20;
+
+// a zstd frame bigger than this is decompressed by the splitter, like the
+// rest of the file after it
+static const size_t maxZstdFrameBufferSize = 64 << 20;
+
+static const size_t gzipHeaderSize = 12;  // up to XLEN
+
+static double now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double megaBytesPerSecond(size_t bytes, double seconds) {
+    return bytes / 1048576.0 / std::max(seconds, 1e-6);
+}
+
+LineReader::LineReader(int thread_num):
+        thread_num_(thread_num),
+        file_(NULL),
+        format_(InputFormat::PLAIN),
+        input_end_(false),
+        next_sequence_(0),
+        consumed_sequence_(0),
+        split_finished_(false),
+        failed_(false),
+        stopping_(false),
+        chunk_(NULL),
+        chunk_offset_(0),
+        read_bytes_(0),
+        read_seconds_(0.0),
+        decompressed_bytes_(0),
+        decompress_seconds_(0.0),
+        parsed_bytes_(0),
+        wait_seconds_(0.0),
+        open_time_(0.0) {
+    if (thread_num_ <= 0) {
+        thread_num_ = std::thread::hardware_concurrency();
+        thread_num_ = thread_num_ > 0 ? thread_num_ : 1;
+    }
+}
+
+bool LineReader::open(const std::string &path) {
+    close();
+    file_ = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if (file_ == NULL) {
+        fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+        return false;
+    }
+    // the magic bytes are peeked, a pipe can not be rewound
+    char header[gzipHeaderSize + 4] = {0};
+    size_t header_size = fread(header, 1, gzipHeaderSize + 4, file_);
+    peeked_.assign(header, header_size);
+    const unsigned char *magic = reinterpret_cast<unsigned char *>(header);
+    format_ = InputFormat::PLAIN;
+    if (header_size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        // bgzip puts the BC subfield with the member size first
+        bool bgzf = header_size >= gzipHeaderSize + 4
+                && (magic[3] & 0x04) != 0
+                && magic[12] == 'B' && magic[13] == 'C'
+                && magic[14] == 2 && magic[15] == 0;
+        format_ = bgzf ? InputFormat::BGZF : InputFormat::GZIP;
+    } else if (header_size >= 4 && magic[0] == 0x28 && magic[1] == 0xb5
+            && magic[2] == 0x2f && magic[3] == 0xfd) {
+        format_ = InputFormat::ZSTD;
+    }
+#ifndef NNCHCLUS_HAVE_ZLIB
+    if (format_ == InputFormat::GZIP || format_ == InputFormat::BGZF) {
+        fprintf(stderr, "%s is gzip, built without zlib!\n", path.c_str());
+        close();
+        return false;
+    }
+#endif
+#ifndef NNCHCLUS_HAVE_ZSTD
+    if (format_ == InputFormat::ZSTD) {
+        fprintf(stderr, "%s is zstd, built without zstd!\n", path.c_str());
+        close();
+        return false;
+    }
+#endif
+    input_end_ = false;
+    next_sequence_ = 0;
+    consumed_sequence_ = 0;
+    split_finished_ = false;
+    failed_ = false;
+    stopping_ = false;
+    chunk_offset_ = 0;
+    read_bytes_ = 0;
+    read_seconds_ = 0.0;
+    decompressed_bytes_ = 0;
+    decompress_seconds_ = 0.0;
+    parsed_bytes_ = 0;
+    wait_seconds_ = 0.0;
+    open_time_ = now();
+    splitter_ = std::thread(&LineReader::splitLoop, this);
+    if (format_ == InputFormat::BGZF || format_ == InputFormat::ZSTD) {
+        for (int i = 0; i < thread_num_; ++i) {
+            workers_.push_back(std::thread(&LineReader::workLoop, this));
+        }
+    }
+    return true;
+}
+
+size_t LineReader::readInput(char *buffer, size_t size) {
+    size_t peeked_size = std::min(size, peeked_.size());
+    memcpy(buffer, peeked_.data(), peeked_size);
+    peeked_.erase(0, peeked_size);
+    size_t read_size = 0;
+    double begin = now();
+    if (peeked_size < size && !input_end_) {
+        read_size = fread(buffer + peeked_size, 1, size - peeked_size, file_);
+        input_end_ = peeked_size + read_size < size;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    read_seconds_ += now() - begin;
+    read_bytes_ += peeked_size + read_size;
+    return peeked_size + read_size;
+}
+
+bool LineReader::submit(Chunk *chunk, bool decompressed) {
+    // every chunk between the splitter and the caller holds memory
+    size_t window = (size_t)thread_num_ * 2 + 4;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (next_sequence_ - consumed_sequence_ >= window && !stopping_) {
+        window_free_.wait(lock);
+    }
+    if (stopping_) {
+        delete chunk;
+        return false;
+    }
+    chunk->sequence = next_sequence_++;
+    if (decompressed) {
+        done_chunks_[chunk->sequence] = chunk;
+        chunk_done_.notify_all();
+    } else {
+        jobs_.push_back(chunk);
+        job_ready_.notify_one();
+    }
+    return true;
+}
+
+void LineReader::splitLoop() {
+    bool success = false;
+    switch (format_) {
+        case InputFormat::GZIP:
+            success = splitGzip();
+            break;
+        case InputFormat::BGZF:
+            success = splitBgzf();
+            break;
+        case InputFormat::ZSTD:
+            success = splitZstd();
+            break;
+        default:
+            success = splitPlain();
+            break;
+    }
+    if (ferror(file_)) {
+        fprintf(stderr, "Read input failed!\n");
+        success = false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!success && !stopping_) {
+        failed_ = true;
+    }
+    split_finished_ = true;
+    job_ready_.notify_all();
+    chunk_done_.notify_all();
+}
+
+bool LineReader::splitPlain() {
+    while (true) {
+        Chunk *chunk = new Chunk();
+        chunk->data.resize(outputChunkSize);
+        size_t size = readInput(&chunk->data[0], outputChunkSize);
+        chunk->data.resize(size);
+        if (size == 0) {
+            delete chunk;
+            return true;
+        }
+        if (!submit(chunk, true)) {
+            return false;
+        }
+    }
+}
+
+/*
+* Decompress a gzip file of any members on the splitter thread, the caller
+* still parses in parallel
+*/
+bool LineReader::splitGzip() {
+#ifdef NNCHCLUS_HAVE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        return false;
+    }
+    std::vector<char> input(inputBlockSize);
+    Chunk *chunk = new Chunk();
+    chunk->data.resize(outputChunkSize);
+    stream.next_out = reinterpret_cast<Bytef *>(&chunk->data[0]);
+    stream.avail_out = outputChunkSize;
+    bool success = true;
+    bool member_end = false;
+    size_t output_size = 0;
+    double busy_seconds = 0.0;
+    while (success) {
+        if (stream.avail_in == 0) {
+            size_t size = readInput(&input[0], inputBlockSize);
+            if (size == 0) {
+                if (!member_end) {
+                    fprintf(stderr, "Truncated gzip input!\n");
+                    success = false;
+                }
+                break;
+            }
+            stream.next_in = reinterpret_cast<Bytef *>(&input[0]);
+            stream.avail_in = size;
+        }
+        double begin = now();
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        busy_seconds += now() - begin;
+        if (ret == Z_STREAM_END) {
+            member_end = true;
+            inflateReset(&stream);  // another member may follow
+        } else if (ret == Z_DATA_ERROR && member_end) {
+            fprintf(stderr, "Trailing garbage after gzip input ignored\n");
+            stream.avail_in = 0;
+            peeked_.clear();
+            input_end_ = true;
+        } else if (ret == Z_OK) {
+            member_end = false;
+        } else {
+            fprintf(stderr, "Decompress gzip input failed: %d\n", ret);
+            success = false;
+        }
+        if (stream.avail_out == 0) {
+            output_size += outputChunkSize;
+            if (!submit(chunk, true)) {
+                chunk = NULL;
+                success = false;
+                break;
+            }
+            chunk = new Chunk();
+            chunk->data.resize(outputChunkSize);
+            stream.next_out = reinterpret_cast<Bytef *>(&chunk->data[0]);
+            stream.avail_out = outputChunkSize;
+        }
+    }
+    if (chunk != NULL) {
+        chunk->data.resize(outputChunkSize - stream.avail_out);
+        output_size += chunk->data.size();
+        if (!success || !submit(chunk, true)) {
+            success = false;
+        }
+    }
+    inflateEnd(&stream);
+    std::lock_guard<std::mutex> lock(mutex_);
+    decompressed_bytes_ += output_size;
+    decompress_seconds_ += busy_seconds;
+    return success;
+#else
+    return false;
+#endif
+}
+
+/*
+* Cut a BGZF file at the member sizes of the headers, the members of a job
+* are decompressed by the workers
+*/
+bool LineReader::splitBgzf() {
+    std::vector<char> header(gzipHeaderSize);
+    std::vector<char> extra;
+    Chunk *job = NULL;
+    while (true) {
+        size_t header_size = readInput(&header[0], gzipHeaderSize);
+        if (header_size == 0) {
+            break;
+        }
+        const unsigned char *magic =
+                reinterpret_cast<unsigned char *>(&header[0]);
+        if (header_size < gzipHeaderSize || magic[0] != 0x1f
+                || magic[1] != 0x8b || (magic[3] & 0x04) == 0) {
+            fprintf(stderr, "Invalid BGZF member header!\n");
+            delete job;
+            return false;
+        }
+        size_t extra_size = magic[10] | (magic[11] << 8);
+        extra.resize(extra_size);
+        if (extra_size == 0
+                || readInput(&extra[0], extra_size) < extra_size) {
+            fprintf(stderr, "Truncated BGZF member header!\n");
+            delete job;
+            return false;
+        }
+        size_t member_size = 0;
+        const unsigned char *field =
+                reinterpret_cast<unsigned char *>(&extra[0]);
+        for (size_t i = 0; i + 4 <= extra_size;
+                i += 4 + (field[i + 2] | (field[i + 3] << 8))) {
+            if (field[i] == 'B' && field[i + 1] == 'C'
+                    && field[i + 2] == 2 && i + 6 <= extra_size) {
+                member_size = (field[i + 4] | (field[i + 5] << 8)) + 1;
+                break;
+            }
+        }
+        if (member_size <= gzipHeaderSize + extra_size) {
+            fprintf(stderr, "BGZF member without its size!\n");
+            delete job;
+            return false;
+        }
+        if (job == NULL) {
+            job = new Chunk();
+        }
+        size_t offset = job->data.size();
+        job->data.resize(offset + member_size);
+        memcpy(&job->data[offset], &header[0], gzipHeaderSize);
+        memcpy(&job->data[offset + gzipHeaderSize], &extra[0], extra_size);
+        size_t body_size = member_size - gzipHeaderSize - extra_size;
+        if (readInput(&job->data[offset + gzipHeaderSize + extra_size],
+                body_size) < body_size) {
+            fprintf(stderr, "Truncated BGZF member!\n");
+            delete job;
+            return false;
+        }
+        if (job->data.size() >= jobInputSize) {
+            if (!submit(job, false)) {
+                return false;
+            }
+            job = NULL;
+        }
+    }
+    return job == NULL || submit(job, false);
+}
+
+/*
+* Cut a zstd file at the frame boundaries, the frames of a job are
+* decompressed by the workers. A frame too big to be buffered is
+* decompressed here, like the rest of the file.
+*/
+bool LineReader::splitZstd() {
+#ifdef NNCHCLUS_HAVE_ZSTD
+    std::vector<char> buffer;
+    size_t begin = 0;  // first byte not cut yet
+    bool end = false;
+    Chunk *job = NULL;
+    while (true) {
+        size_t available = buffer.size() - begin;
+        if (available > 0) {
+            size_t frame_size = ZSTD_findFrameCompressedSize(
+                    &buffer[begin], available);
+            if (!ZSTD_isError(frame_size)) {
+                if (job == NULL) {
+                    job = new Chunk();
+                }
+                job->data.insert(job->data.end(), buffer.begin() + begin,
+                        buffer.begin() + begin + frame_size);
+                begin += frame_size;
+                if (job->data.size() >= jobInputSize) {
+                    if (!submit(job, false)) {
+                        return false;
+                    }
+                    job = NULL;
+                }
+                continue;
+            }
+        }
+        if (end) {
+            if (available > 0) {
+                fprintf(stderr, "Truncated zstd input!\n");
+                delete job;
+                return false;
+            }
+            break;
+        }
+        if (available >= maxZstdFrameBufferSize) {
+            break;
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + begin);
+        begin = 0;
+        size_t offset = buffer.size();
+        buffer.resize(offset + inputBlockSize);
+        size_t size = readInput(&buffer[offset], inputBlockSize);
+        buffer.resize(offset + size);
+        end = size < inputBlockSize;
+    }
+    if (job != NULL && !submit(job, false)) {
+        return false;
+    }
+    if (buffer.size() == begin) {
+        return true;
+    }
+
+    // a huge frame: stream the rest of the file on this thread
+    fprintf(stderr, "zstd frame bigger than %lu bytes,"
+            " decompressed sequentially\n", maxZstdFrameBufferSize);
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_initDStream(stream);
+    ZSTD_inBuffer input = {&buffer[begin], buffer.size() - begin, 0};
+    std::vector<char> input_block(inputBlockSize);
+    size_t ret = 0;
+    bool success = true;
+    size_t output_size = 0;
+    double busy_seconds = 0.0;
+    while (success) {
+        if (input.pos == input.size) {
+            size_t size = readInput(&input_block[0], inputBlockSize);
+            if (size == 0) {
+                if (ret != 0) {
+                    fprintf(stderr, "Truncated zstd input!\n");
+                    success = false;
+                }
+                break;
+            }
+            input.src = &input_block[0];
+            input.size = size;
+            input.pos = 0;
+        }
+        Chunk *chunk = new Chunk();
+        chunk->data.resize(outputChunkSize);
+        ZSTD_outBuffer output = {&chunk->data[0], outputChunkSize, 0};
+        double begin_time = now();
+        while (output.pos < output.size && input.pos < input.size) {
+            ret = ZSTD_decompressStream(stream, &output, &input);
+            if (ZSTD_isError(ret)) {
+                fprintf(stderr, "Decompress zstd input failed: %s\n",
+                        ZSTD_getErrorName(ret));
+                success = false;
+                break;
+            }
+        }
+        busy_seconds += now() - begin_time;
+        chunk->data.resize(output.pos);
+        output_size += output.pos;
+        if (!success || !submit(chunk, true)) {
+            success = false;
+        }
+    }
+    ZSTD_freeDStream(stream);
+    std::lock_guard<std::mutex> lock(mutex_);
+    decompressed_bytes_ += output_size;
+    decompress_seconds_ += busy_seconds;
+    return success;
+#else
+    return false;
+#endif
+}
+
+/*
+* Decompress a job of whole BGZF members or zstd frames
+*/
+bool LineReader::decompress(const std::vector<char> &input,
+        std::vector<char> *output) {
+    output->resize(std::max(input.size() * 4, (size_t)1 << 16));
+    size_t output_size = 0;
+#ifdef NNCHCLUS_HAVE_ZLIB
+    if (format_ == InputFormat::BGZF) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+            return false;
+        }
+        stream.next_in = reinterpret_cast<Bytef *>(
+                const_cast<char *>(&input[0]));
+        stream.avail_in = input.size();
+        int ret = Z_OK;
+        while (true) {
+            if (output_size == output->size()) {
+                output->resize(output->size() << 1);
+            }
+            stream.next_out = reinterpret_cast<Bytef *>(
+                    &(*output)[output_size]);
+            stream.avail_out = output->size() - output_size;
+            ret = inflate(&stream, Z_NO_FLUSH);
+            output_size = output->size() - stream.avail_out;
+            if (ret == Z_STREAM_END) {
+                if (stream.avail_in == 0) {
+                    break;
+                }
+                inflateReset(&stream);  // the next member
+            } else if (ret != Z_OK) {
+                break;  // a truncated member ends with Z_BUF_ERROR
+            }
+        }
+        inflateEnd(&stream);
+        if (ret != Z_STREAM_END) {
+            fprintf(stderr, "Decompress BGZF member failed: %d\n", ret);
+            return false;
+        }
+    }
+#endif
+#ifdef NNCHCLUS_HAVE_ZSTD
+    if (format_ == InputFormat::ZSTD) {
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+        ZSTD_inBuffer in = {&input[0], input.size(), 0};
+        size_t ret = 0;
+        // a frame may still have output once its input is consumed
+        while (in.pos < in.size || ret != 0) {
+            if (output_size == output->size()) {
+                output->resize(output->size() << 1);
+            }
+            ZSTD_outBuffer out = {&(*output)[0], output->size(), output_size};
+            size_t in_pos = in.pos;
+            ret = ZSTD_decompressStream(stream, &out, &in);
+            bool progress = out.pos > output_size || in.pos > in_pos;
+            output_size = out.pos;
+            if (ZSTD_isError(ret) || !progress) {
+                fprintf(stderr, "Decompress zstd frame failed: %s\n",
+                        ZSTD_isError(ret) ? ZSTD_getErrorName(ret)
+                                : "truncated");
+                ZSTD_freeDStream(stream);
+                return false;
+            }
+        }
+        ZSTD_freeDStream(stream);
+    }
+#endif
+    output->resize(output_size);
+    return true;
+}
+
+void LineReader::workLoop() {
+    std::vector<char> output;
+    while (true) {
+        Chunk *job = NULL;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (jobs_.empty() && !split_finished_ && !stopping_) {
+                job_ready_.wait(lock);
+            }
+            if (stopping_ || jobs_.empty()) {
+                return;
+            }
+            job = jobs_.front();
+            jobs_.pop_front();
+        }
+        double begin = now();
+        bool success = decompress(job->data, &output);
+        job->data.swap(output);
+        double busy_seconds = now() - begin;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        decompress_seconds_ += busy_seconds;
+        if (!success) {
+            delete job;
+            failed_ = true;
+            chunk_done_.notify_all();
+            return;
+        }
+        decompressed_bytes_ += job->data.size();
+        done_chunks_[job->sequence] = job;
+        chunk_done_.notify_all();
+    }
+}
+
+/*
+* Next decompressed chunk in the order of the file, NULL at the end or on
+* an error
+*/
+LineReader::Chunk *LineReader::nextChunk() {
+    double begin = now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::map<size_t, Chunk *>::iterator it;
+    while ((it = done_chunks_.find(consumed_sequence_)) == done_chunks_.end()
+            && !failed_ && !stopping_
+            && !(split_finished_ && consumed_sequence_ == next_sequence_)) {
+        chunk_done_.wait(lock);
+    }
+    wait_seconds_ += now() - begin;
+    if (failed_ || it == done_chunks_.end()) {
+        return NULL;
+    }
+    Chunk *chunk = it->second;
+    done_chunks_.erase(it);
+    ++consumed_sequence_;
+    parsed_bytes_ += chunk->data.size();
+    window_free_.notify_all();
+    return chunk;
+}
+
+bool LineReader::readLine(std::string *line) {
+    line->clear();
+    while (true) {
+        if (chunk_ == NULL || chunk_offset_ >= chunk_->data.size()) {
+            delete chunk_;
+            chunk_ = nextChunk();
+            chunk_offset_ = 0;
+            if (chunk_ == NULL) {
+                return !failed_ && !line->empty();
+            }
+            continue;
+        }
+        const char *begin = &chunk_->data[chunk_offset_];
+        size_t size = chunk_->data.size() - chunk_offset_;
+        const char *end = static_cast<const char *>(memchr(begin, '\n', size));
+        if (end != NULL) {
+            line->append(begin, end - begin);
+            chunk_offset_ += end - begin + 1;
+            return true;
+        }
+        // the line goes on in the next chunk
+        line->append(begin, size);
+        chunk_offset_ += size;
+    }
+}
+
+bool LineReader::readBlock(const char **data, size_t *size) {
+    while (chunk_ == NULL || chunk_offset_ >= chunk_->data.size()) {
+        delete chunk_;
+        chunk_ = nextChunk();
+        chunk_offset_ = 0;
+        if (chunk_ == NULL) {
+            return false;
+        }
+    }
+    *data = &chunk_->data[chunk_offset_];
+    *size = chunk_->data.size() - chunk_offset_;
+    chunk_offset_ = chunk_->data.size();
+    return true;
+}
+
+void LineReader::reportThroughput() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    double parse_seconds = now() - open_time_ - wait_seconds_;
+    fprintf(stderr, "Input %s: read %.1f MB in %.1fs (%.1f MB/s)",
+            InputFormat::getName(format_), read_bytes_ / 1048576.0,
+            read_seconds_, megaBytesPerSecond(read_bytes_, read_seconds_));
+    if (format_ != InputFormat::PLAIN) {
+        int thread_num = format_ == InputFormat::BGZF
+                || format_ == InputFormat::ZSTD ? thread_num_ : 1;
+        fprintf(stderr, ", decompressed %.1f MB on %d threads in %.1fs"
+                " (%.1f MB/s per thread)", decompressed_bytes_ / 1048576.0,
+                thread_num, decompress_seconds_,
+                megaBytesPerSecond(decompressed_bytes_, decompress_seconds_));
+    }
+    fprintf(stderr, ", parsed %.1f MB in %.1fs (%.1f MB/s),"
+            " waited %.1fs for input\n", parsed_bytes_ / 1048576.0,
+            parse_seconds, megaBytesPerSecond(parsed_bytes_, parse_seconds),
+            wait_seconds_);
+}
+
+void LineReader::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        job_ready_.notify_all();
+        window_free_.notify_all();
+        chunk_done_.notify_all();
+    }
+    if (splitter_.joinable()) {
+        splitter_.join();
+    }
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i].join();
+    }
+    workers_.clear();
+    for (size_t i = 0; i < jobs_.size(); ++i) {
+        delete jobs_[i];
+    }
+    jobs_.clear();
+    for (std::map<size_t, Chunk *>::iterator it = done_chunks_.begin();
+            it != done_chunks_.end(); ++it) {
+        delete it->second;
+    }
+    done_chunks_.clear();
+    delete chunk_;
+    chunk_ = NULL;
+    peeked_.clear();
+    if (file_ != NULL && file_ != stdin) {
+        fclose(file_);
+    }
+    file_ = NULL;
+}
+
+}  // namespace cluster
@@ -0,0 +1,164 @@
+//
+// Cluster one distance matrix with several linkages.
+//
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "multi_linkage_clusterer.h"
+
+namespace cluster {
+
+static void runCluster(AgglHierClusterer *clusterer, char *success) {
+    *success = clusterer->doCluster() ? 1 : 0;
+    clusterer->releaseDistanceMatrix();
+}
+
+MultiLinkageClusterer::MultiLinkageClusterer(
+        const std::vector<DistanceCalculatorType::Type> &types,
+        bool copy_on_write,
+        int max_thread_num):
+        types_(types),
+        copy_on_write_(copy_on_write),
+        max_thread_num_(max_thread_num),
+        base_clusterer_(NULL),
+        clusterers_(types.size(), NULL) {}
+
+MultiLinkageClusterer::~MultiLinkageClusterer() {
+    delete base_clusterer_;
+    for (size_t i = 0; i < clusterers_.size(); ++i) {
+        delete clusterers_[i];
+    }
+}
+
+bool MultiLinkageClusterer::init(int base_node_num,
+        const std::string &distance_file_path) {
+    if (types_.empty()) {
+        fprintf(stderr, "No linkage to cluster with!\n");
+        return false;
+    }
+    for (size_t i = 0; i < types_.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (types_[i] == types_[j]) {
+                fprintf(stderr, "Linkage %s is given twice!\n",
+                        DistanceCalculatorType::getName(types_[i]));
+                return false;
+            }
+        }
+    }
+    delete base_clusterer_;
+    // the linkage of the base does not matter, it never clusters
+    base_clusterer_ = new AgglHierClusterer(types_[0]);
+    base_clusterer_->setDistanceMatrixStorageType(copy_on_write_ ?
+            DistanceMatrixStorageType::SHARED_MEMORY :
+            DistanceMatrixStorageType::HEAP);
+    return base_clusterer_->init(base_node_num, distance_file_path);
+}
+
+/*
+* Every running linkage needs a full copy of the matrix in the worst case:
+* copy-on-write mappings end up copying most pages, since the rows of merged
+* nodes are rewritten during the cluster.
+*/
+int MultiLinkageClusterer::getConcurrentNum() const {
+    int concurrent_num = static_cast<int>(types_.size());
+    if (max_thread_num_ > 0 && max_thread_num_ < concurrent_num) {
+        concurrent_num = max_thread_num_;
+    }
+    size_t linkage_bytes = base_clusterer_->getDistanceMatrixByteSize()
+            + sizeof(ClusterNode) * ((base_clusterer_->getBaseNodeNum() << 1) - 1);  // NOLINT
+#ifdef _SC_AVPHYS_PAGES
+    long available_pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (available_pages > 0 && page_size > 0 && linkage_bytes > 0) {
+        size_t memory_limit_num =
+                (size_t)available_pages * (size_t)page_size / linkage_bytes;
+        if (memory_limit_num < (size_t)concurrent_num) {
+            concurrent_num = (int)memory_limit_num;
+        }
+    }
+#endif
+    return concurrent_num > 0 ? concurrent_num : 1;
+}
+
+bool MultiLinkageClusterer::doCluster() {
+    assert(base_clusterer_ != NULL);
+    int concurrent_num = getConcurrentNum();
+    fprintf(stderr, "Cluster %lu linkages, %d at the same time\n",
+            types_.size(), concurrent_num);
+
+    for (size_t begin = 0; begin < types_.size(); begin += concurrent_num) {
+        size_t end = begin + concurrent_num;
+        if (end > types_.size()) {
+            end = types_.size();
+        }
+        for (size_t i = begin; i < end; ++i) {
+            delete clusterers_[i];
+            clusterers_[i] = new AgglHierClusterer(types_[i]);
+            if (!clusterers_[i]->initFrom(*base_clusterer_, copy_on_write_)) {
+                fprintf(stderr, "Init of linkage %s failed!\n",
+                        DistanceCalculatorType::getName(types_[i]));
+                return false;
+            }
+        }
+
+        std::vector<char> success(end - begin, 0);
+        std::vector<std::thread> threads;
+        for (size_t i = begin + 1; i < end; ++i) {
+            threads.push_back(std::thread(runCluster,
+                    clusterers_[i], &success[i - begin]));
+        }
+        runCluster(clusterers_[begin], &success[0]);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+
+        for (size_t i = begin; i < end; ++i) {
+            if (!success[i - begin]) {
+                fprintf(stderr, "Cluster with linkage %s failed!\n",
+                        DistanceCalculatorType::getName(types_[i]));
+                return false;
+            }
+            fprintf(stderr, "Cluster with linkage %s success!\n",
+                    DistanceCalculatorType::getName(types_[i]));
+        }
+    }
+    base_clusterer_->releaseDistanceMatrix();
+    return true;
+}
+
+std::string MultiLinkageClusterer::getOutputFileName(
+        const std::string &file_prefix,
+        size_t linkage_index) const {
+    return file_prefix + "."
+            + DistanceCalculatorType::getName(types_[linkage_index]);
+}
+
+bool MultiLinkageClusterer::output(const std::string &file_prefix,
+        float distance_threshold) {
+    for (size_t i = 0; i < clusterers_.size(); ++i) {
+        if (clusterers_[i] == NULL || !clusterers_[i]->output(
+                getOutputFileName(file_prefix, i) + ".cluster",
+                distance_threshold)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MultiLinkageClusterer::output(const std::string &file_prefix) {
+    for (size_t i = 0; i < clusterers_.size(); ++i) {
+        if (clusterers_[i] == NULL
+                || !clusterers_[i]->output(getOutputFileName(file_prefix, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace cluster
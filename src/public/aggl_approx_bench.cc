@@ -0,0 +1,255 @@
+//
+// Compare the approximate knn mode with the exact cluster of the same
+// features: time, cophenetic correlation of the two trees and adjusted rand
+// index of flat cuts.
+//
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "aggl_hier_clusterer.h"
+
+using cluster::AgglHierClusterer;
+using cluster::ClusterNode;
+using cluster::DistanceCalculatorType;
+
+static double now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// leaves of every node, children first as the labels go
+static void collectLeaves(const AgglHierClusterer &clusterer,
+        std::vector<std::vector<int> > *leaves) {
+    const ClusterNode *nodes = clusterer.getClusterNodeArray();
+    leaves->assign(clusterer.getNodeNum(), std::vector<int>());
+    for (int i = 0; i < clusterer.getNodeNum(); ++i) {
+        if (nodes[i].getLeftChildLabel() < 0) {
+            (*leaves)[i].push_back(i);
+        }
+    }
+}
+
+/*
+* Call visit(left_leaf, right_leaf, height) for every pair of leaves, with
+* the height of the node where they meet
+*/
+template <typename Visitor>
+static void visitCopheneticPairs(const AgglHierClusterer &clusterer,
+        Visitor *visit) {
+    const ClusterNode *nodes = clusterer.getClusterNodeArray();
+    std::vector<std::vector<int> > leaves;
+    collectLeaves(clusterer, &leaves);
+    for (int i = clusterer.getBaseNodeNum(); i < clusterer.getNodeNum(); ++i) {
+        std::vector<int> &left = leaves[nodes[i].getLeftChildLabel()];
+        std::vector<int> &right = leaves[nodes[i].getRightChildLabel()];
+        for (size_t l = 0; l < left.size(); ++l) {
+            for (size_t r = 0; r < right.size(); ++r) {
+                (*visit)(left[l], right[r], nodes[i].getDistance());
+            }
+        }
+        leaves[i].swap(left);
+        leaves[i].insert(leaves[i].end(), right.begin(), right.end());
+        std::vector<int>().swap(right);
+    }
+}
+
+static size_t pairIndex(int left, int right) {
+    if (left < right) {
+        std::swap(left, right);
+    }
+    return (((size_t)left * (left - 1)) >> 1) + right;
+}
+
+struct CopheneticFiller {
+    std::vector<float> *heights;
+
+    void operator()(int left, int right, float height) {
+        (*heights)[pairIndex(left, right)] = height;
+    }
+};
+
+// pearson correlation of the heights of the two trees over all pairs
+struct CopheneticCorrelator {
+    const std::vector<float> *exact_heights;
+    double sum_x, sum_y, sum_xx, sum_yy, sum_xy, num;
+
+    void operator()(int left, int right, float height) {
+        double x = (*exact_heights)[pairIndex(left, right)];
+        sum_x += x;
+        sum_y += height;
+        sum_xx += x * x;
+        sum_yy += (double)height * height;
+        sum_xy += x * height;
+        num += 1;
+    }
+
+    double correlation() const {
+        double covariance = sum_xy - sum_x * sum_y / num;
+        double variance = (sum_xx - sum_x * sum_x / num)
+                * (sum_yy - sum_y * sum_y / num);
+        return variance > 0.0 ? covariance / sqrt(variance) : 0.0;
+    }
+};
+
+/*
+* Cut the tree into cluster_num clusters by undoing the highest merges,
+* classes[leaf label] gets the cluster of the leaf
+*/
+static void cutTree(const AgglHierClusterer &clusterer,
+        int cluster_num,
+        std::vector<int> *classes) {
+    const ClusterNode *nodes = clusterer.getClusterNodeArray();
+    std::priority_queue<std::pair<float, int> > tops;
+    tops.push(std::make_pair(nodes[clusterer.getNodeNum() - 1].getDistance(),
+            clusterer.getNodeNum() - 1));
+    std::vector<int> roots;
+    while ((int)(tops.size() + roots.size()) < cluster_num && !tops.empty()) {
+        int label = tops.top().second;
+        tops.pop();
+        int children[2] = {nodes[label].getLeftChildLabel(),
+                nodes[label].getRightChildLabel()};
+        for (int i = 0; i < 2; ++i) {
+            if (nodes[children[i]].getLeftChildLabel() < 0) {
+                roots.push_back(children[i]);
+            } else {
+                tops.push(std::make_pair(nodes[children[i]].getDistance(),
+                        children[i]));
+            }
+        }
+    }
+    for (; !tops.empty(); tops.pop()) {
+        roots.push_back(tops.top().second);
+    }
+    classes->assign(clusterer.getBaseNodeNum(), -1);
+    for (size_t c = 0; c < roots.size(); ++c) {
+        std::vector<int> stack(1, roots[c]);
+        while (!stack.empty()) {
+            int label = stack.back();
+            stack.pop_back();
+            if (nodes[label].getLeftChildLabel() < 0) {
+                (*classes)[label] = c;
+            } else {
+                stack.push_back(nodes[label].getLeftChildLabel());
+                stack.push_back(nodes[label].getRightChildLabel());
+            }
+        }
+    }
+}
+
+static double pairNum(double n) {
+    return n * (n - 1) / 2;
+}
+
+static double adjustedRandIndex(const std::vector<int> &left,
+        const std::vector<int> &right,
+        int class_num) {
+    std::vector<double> table((size_t)class_num * class_num, 0.0);
+    std::vector<double> left_sums(class_num, 0.0);
+    std::vector<double> right_sums(class_num, 0.0);
+    for (size_t i = 0; i < left.size(); ++i) {
+        table[(size_t)left[i] * class_num + right[i]] += 1;
+        left_sums[left[i]] += 1;
+        right_sums[right[i]] += 1;
+    }
+    double index = 0.0, left_index = 0.0, right_index = 0.0;
+    for (size_t i = 0; i < table.size(); ++i) {
+        index += pairNum(table[i]);
+    }
+    for (int i = 0; i < class_num; ++i) {
+        left_index += pairNum(left_sums[i]);
+        right_index += pairNum(right_sums[i]);
+    }
+    double expected = left_index * right_index / pairNum(left.size());
+    double max_index = (left_index + right_index) / 2;
+    return max_index == expected ? 1.0 :
+            (index - expected) / (max_index - expected);
+}
+
+static bool runCluster(AgglHierClusterer *clusterer,
+        int node_num,
+        const char *feature_file,
+        int knn_k,
+        double *seconds) {
+    double begin = now();
+    if (!clusterer->initFromFeatures(node_num, feature_file, knn_k)
+            || !clusterer->doCluster()) {
+        return false;
+    }
+    *seconds = now() - begin;
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: aggl_approx_bench feature_file node_num"
+                " knn_k [linkage]\n");
+        return 1;
+    }
+    int node_num = atoi(argv[2]);
+    int knn_k = atoi(argv[3]);
+    if (node_num <= 1 || knn_k <= 0) {
+        fprintf(stderr, "Node num must bigger than one and knn_k bigger"
+                " than zero!\n");
+        return 1;
+    }
+    DistanceCalculatorType::Type type = DistanceCalculatorType::AVERAGE;
+    if (argc == 5) {
+        int i = DistanceCalculatorType::SINGLE_LINK;
+        for (; i <= DistanceCalculatorType::WARD; ++i) {
+            if (strcmp(argv[4], DistanceCalculatorType::getName(
+                    (DistanceCalculatorType::Type)i)) == 0) {
+                break;
+            }
+        }
+        if (i > DistanceCalculatorType::WARD) {
+            fprintf(stderr, "Unknown linkage %s\n", argv[4]);
+            return 1;
+        }
+        type = (DistanceCalculatorType::Type)i;
+    }
+
+    AgglHierClusterer exact(type);
+    AgglHierClusterer approximate(type);
+    double exact_seconds = 0.0, approximate_seconds = 0.0;
+    if (!runCluster(&exact, node_num, argv[1], 0, &exact_seconds)) {
+        fprintf(stderr, "====exact cluster failed!\n");
+        return 1;
+    }
+    exact.releaseDistanceMatrix();
+    if (!runCluster(&approximate, node_num, argv[1], knn_k,
+            &approximate_seconds)) {
+        fprintf(stderr, "====approximate cluster failed!\n");
+        return 1;
+    }
+    printf("linkage\t%s\nnode_num\t%d\nknn_k\t%d\n",
+            DistanceCalculatorType::getName(type), node_num, knn_k);
+    printf("exact_seconds\t%.3f\napproximate_seconds\t%.3f\n",
+            exact_seconds, approximate_seconds);
+
+    std::vector<float> exact_heights(
+            ((size_t)node_num * (node_num - 1)) >> 1, 0.0);
+    CopheneticFiller filler = {&exact_heights};
+    visitCopheneticPairs(exact, &filler);
+    CopheneticCorrelator correlator = {&exact_heights, 0, 0, 0, 0, 0, 0};
+    visitCopheneticPairs(approximate, &correlator);
+    printf("cophenetic_correlation\t%.4f\n", correlator.correlation());
+
+    static const int cluster_nums[] = {2, 5, 10, 20, 50, 100};
+    for (size_t i = 0; i < sizeof(cluster_nums) / sizeof(int); ++i) {
+        if (cluster_nums[i] >= node_num) {
+            break;
+        }
+        std::vector<int> exact_classes, approximate_classes;
+        cutTree(exact, cluster_nums[i], &exact_classes);
+        cutTree(approximate, cluster_nums[i], &approximate_classes);
+        printf("ari_%d\t%.4f\n", cluster_nums[i], adjustedRandIndex(
+                exact_classes, approximate_classes, cluster_nums[i]));
+    }
+    return 0;
+}
@@ -7,35 +7,154 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 #include <cstdio>
 #include <assert.h>
 
 #include "cluster_node.h"
 #include "distance_calculator.h"
+#include "distance_matrix_storage.h"
 
 namespace cluster {
+struct ClusterCheckpoint;
+
 class AgglHierClusterer {
 private:
     int node_num_;  // util now how many cluster node have been created
 
     int base_node_num_;  // num of nodes who has no child
 
+    int sample_num_;  // num of samples, bigger than base_node_num_ if
+                      // duplicate samples are collapsed
+
+    // samples closer than this are collapsed into one leaf, negative for
+    // no collapse
+    float duplicate_epsilon_;
+
+    // duplicate_names_[leaf label]: names of the samples collapsed into the
+    // leaf besides its own
+    std::vector<std::vector<std::string> > duplicate_names_;
+
     float *distance_matrix_;
 
+    // where distance_matrix_ lives, see init() and initFrom()
+    DistanceMatrixStorage distance_matrix_storage_;
+
+    DistanceMatrixStorageType::Type distance_matrix_storage_type_;
+
+    // out-of-core matrix file, empty to keep the matrix in memory
+    std::string out_of_core_file_;
+
+    // The out-of-core matrix is stored in tiles of 32 * 32 floats, one page
+    // each, so that the column part of a row scan touches one page per 32
+    // rows instead of one page per row
+    bool tiled_distance_matrix_;
+
+    int io_report_interval_;  // merges between two I/O reports, 0 for none
+
+    size_t dirtied_tile_num_;  // tiles written by aggregate()
+
+    std::vector<int> tile_write_mark_;  // last merge writing each tile column
+
+    // (begin, float_num) of the tiles of a row, see prefetchDistanceRow()
+    std::vector<std::pair<size_t, size_t> > prefetch_ranges_;
+
+    std::string checkpoint_file_;  // empty for no checkpoint
+
+    int checkpoint_interval_;  // seconds between two checkpoints
+
+    // input files of init() with their sizes and modification times, a
+    // checkpoint is only resumed for the same input
+    std::string input_identity_;
+
+    // state of doCluster() restored by init() from a checkpoint
+    std::vector<int> resumed_chain_;
+
+    int resumed_nearest_neighbor_label_;
+
+    float resumed_nearest_distance_;
+
+    // Approximate mode of initFromFeatures(): instead of the whole matrix,
+    // every live node only knows the distances to a few candidates, starting
+    // from the knn_k_ nearest neighbors of each sample. 0 for exact mode.
+    int knn_k_;
+
+    int feature_dimension_;
+
+    // features_[dis label * feature_dimension_ ...]: centroid of the live
+    // node of each dis label, only kept in approximate mode
+    std::vector<float> features_;
+
+    // (dis label, distance) pairs, symmetric: if a knows b, b knows a
+    typedef std::pair<int, float> Candidate;
+
+    std::vector<std::vector<Candidate> > candidates_;  // by dis label
+
+    std::vector<int> dis_label_owners_;  // live node label of each dis label
+
     ClusterNode *cluster_node_array_;
 
+    int cluster_node_capacity_;  // size of cluster_node_array_
+
     // The cluster name to cluster label_ mapping
     std::map<std::string, int> node_name_map_;
 
+    DistanceCalculatorType::Type distance_calculator_type_;
+
     const DistanceCalculator * distance_calculator_;
 
 private:
     std::vector<std::string> splitString(std::string input,
             std::string seg_pattern);
 
+    bool parseDistanceLine(const std::string &line,
+            std::string *left_name,
+            std::string *right_name,
+            float *distance);
+
+    bool collapseDuplicates(const std::string &file_name,
+            std::vector<std::string> *leaf_names,
+            std::vector<int> *leaf_sizes);
+
+    bool isCollapsedLeaf(const ClusterNode &node) const {
+        return node.getLabel() >= 0
+                && (size_t)node.getLabel() < duplicate_names_.size()
+                && !duplicate_names_[node.getLabel()].empty();
+    }
+
+    void outputLeafNames(FILE *out_file, const ClusterNode &leaf_node);
+
+    int outputCollapsedLeaf(FILE *out_file,
+            const ClusterNode &leaf_node,
+            int next_label);
+
     int findNearestNeighbor(const ClusterNode &node, float *distance);
 
+    bool loadFeatures(const std::string &file_name);
+
+    // name of label i on line i
+    bool loadNodeNames(const std::string &file_name);
+
+    bool loadBinaryStream(const std::string &stream_path);
+
+    // linkage distance between two clusters computed from their centroids
+    float getFeatureDistance(int left_dis_label,
+            int left_size,
+            int right_dis_label,
+            int right_size) const;
+
+    bool initCandidates();
+
+    // link the connected components of the candidate graph, so that no
+    // node runs out of candidates before the last merge
+    void connectCandidates();
+
+    // make every live node a candidate of every other one
+    void completeCandidates();
+
+    bool doApproximateCluster();
+
     inline size_t getDistanceMatrixIndex(const ClusterNode &left_node,
             const ClusterNode &right_node) {
         size_t left_dis_label = left_node.getDistanceMatrixLabel();
@@ -43,9 +162,43 @@ private:
         return getDistanceMatrixIndex(left_dis_label, right_dis_label);
     }
 
+    static const size_t distanceTileShift = 5;  // tile edge is 32
+
+    // Number of floats of the matrix for node_num base nodes
+    size_t getDistanceMatrixSize(size_t node_num) const {
+        if (tiled_distance_matrix_) {
+            size_t tile_num = (node_num + (1 << distanceTileShift) - 1)
+                    >> distanceTileShift;
+            return ((tile_num * (tile_num + 1)) >> 1)
+                    << (distanceTileShift << 1);
+        }
+        return (node_num * (node_num - 1)) >> 1;
+    }
+
+    inline size_t getTiledDistanceMatrixIndex(size_t row_dis_label,
+            size_t column_dis_label) {
+        static const size_t tile_mask = (1 << distanceTileShift) - 1;
+        size_t row_tile = row_dis_label >> distanceTileShift;
+        size_t column_tile = column_dis_label >> distanceTileShift;
+        return ((((row_tile * (row_tile + 1)) >> 1) + column_tile)
+                << (distanceTileShift << 1))
+                + ((row_dis_label & tile_mask) << distanceTileShift)
+                + (column_dis_label & tile_mask);
+    }
+
+    // Start reading the out-of-core pages holding the distances of dis_label
+    void prefetchDistanceRow(size_t dis_label);
+
     inline size_t getDistanceMatrixIndex(size_t left_dis_label,
             size_t right_dis_label) {
         assert(left_dis_label != right_dis_label);
+        if (tiled_distance_matrix_) {
+            return left_dis_label > right_dis_label ?
+                    getTiledDistanceMatrixIndex(left_dis_label,
+                            right_dis_label) :
+                    getTiledDistanceMatrixIndex(right_dis_label,
+                            left_dis_label);
+        }
         if (left_dis_label > right_dis_label) {
             return ((left_dis_label * (left_dis_label - 1)) >> 1)
                     + right_dis_label;
@@ -55,11 +208,49 @@ private:
         }
     }
 
+    bool reserveClusterNodes(int capacity);
+
+    bool allocateDistanceMatrix();
+
+    ClusterCheckpoint *takeCheckpoint(const std::vector<int> &chain,
+            int nearest_neighbor_label,
+            float nearest_distance);
+
+    // redo the merges of a checkpoint on the freshly loaded matrix
+    bool replayCheckpoint(const ClusterCheckpoint &checkpoint);
+
+    // Resume from the checkpoint file if it matches the input, the samples
+    // and the linkage; return false if it matches but can not be restored.
+    // Called once the matrix is loaded.
+    bool resumeIfCheckpointed();
+
+    // label of the node which is nobody's child
+    int findRootLabel() const;
+
+    // target_label is the node insert() merged the sample with, the sample
+    // is a duplicate in that leaf if sample_label equals it
+    float getCopheneticCorrelation(int sample_label,
+            int target_label,
+            const std::vector<int> &parent_labels,
+            const std::vector<float> &leaf_distances) const;
+
+    // fill the node of label node_num_ as the merge of two nodes, the
+    // children lose their dis labels
+    ClusterNode *createMergedNode(ClusterNode *left_node,
+            ClusterNode *right_node,
+            float distance);
+
     //  aggregate two nodes; return the label of new node
     int aggregate(ClusterNode* left_node,
             ClusterNode* right_node,
             float distance);
 
+    // aggregate two nodes of the approximate mode, the candidates of the
+    // new node are the union of the children's
+    int aggregateCandidates(ClusterNode *left_node,
+            ClusterNode *right_node,
+            float distance);
+
 public:
     int getBaseNodeNum() const {
         return base_node_num_;
@@ -69,6 +260,21 @@ public:
         base_node_num_ = base_node_num;
     }
 
+    int getSampleNum() const {
+        return sample_num_;
+    }
+
+    float getDuplicateEpsilon() const {
+        return duplicate_epsilon_;
+    }
+
+    // Collapse the samples whose distance is not bigger than epsilon before
+    // clustering (0 for exact duplicates, negative to disable). Must be set
+    // before init(); init() then reads the distance file twice.
+    void setDuplicateEpsilon(float epsilon) {
+        duplicate_epsilon_ = epsilon;
+    }
+
     float *getDistanceMatrix() const {
         return distance_matrix_;
     }
@@ -85,6 +291,62 @@ public:
         clusterNodeArray = clusterNodeArray;
     }
 
+    int getNodeNum() const {
+        return node_num_;
+    }
+
+    DistanceCalculatorType::Type getDistanceCalculatorType() const {
+        return distance_calculator_type_;
+    }
+
+    DistanceMatrixStorageType::Type getDistanceMatrixStorageType() const {
+        return distance_matrix_storage_type_;
+    }
+
+    // Storage used by init(). Use SHARED_MEMORY for a clusterer whose matrix
+    // will be shared copy-on-write by other clusterers through initFrom()
+    void setDistanceMatrixStorageType(DistanceMatrixStorageType::Type type) {
+        distance_matrix_storage_type_ = type;
+    }
+
+    const std::string &getOutOfCoreFile() const {
+        return out_of_core_file_;
+    }
+
+    // Keep the matrix in a tiled file at path instead of memory, for matrices
+    // bigger than RAM. Put it on a local SSD. Must be set before init().
+    void setOutOfCoreFile(const std::string &path) {
+        out_of_core_file_ = path;
+    }
+
+    // Report the I/O volume per merge every interval merges during
+    // doCluster(), 0 to report only once at the end of an out-of-core run
+    void setIoReportInterval(int interval) {
+        io_report_interval_ = interval;
+    }
+
+    const std::string &getCheckpointFile() const {
+        return checkpoint_file_;
+    }
+
+    // Checkpoint doCluster() to file_name every interval_seconds. Only the
+    // merges done so far and the nearest neighbor chain are saved, by a
+    // background thread. init() resumes from the checkpoint if it exists and
+    // matches the input file, the samples and the linkage: it loads the
+    // matrix as usual and replays the merges. A resume thus always pays the
+    // whole load again, only the nearest neighbor searches of the replayed
+    // merges are saved: when the load dominates the run, a restart costs
+    // about as much as the first run. The checkpoint is removed when the
+    // cluster is complete.
+    void setCheckpoint(const std::string &file_name, int interval_seconds) {
+        checkpoint_file_ = file_name;
+        checkpoint_interval_ = interval_seconds;
+    }
+
+    size_t getDistanceMatrixByteSize() const {
+        return distance_matrix_storage_.getByteSize();
+    }
+
     std::map<std::string, int> const &getNodeNameMap() const {
         return node_name_map_;
     }
@@ -97,8 +359,21 @@ public:
     AgglHierClusterer(DistanceCalculatorType::Type type = DistanceCalculatorType::AVERAGE):  // NOLINT
             node_num_(0),
             base_node_num_(0),
+            sample_num_(0),
+            duplicate_epsilon_(-1.0),
             distance_matrix_(NULL),
-            cluster_node_array_(NULL) {
+            distance_matrix_storage_type_(DistanceMatrixStorageType::HEAP),
+            tiled_distance_matrix_(false),
+            io_report_interval_(0),
+            dirtied_tile_num_(0),
+            checkpoint_interval_(0),
+            resumed_nearest_neighbor_label_(-1),
+            resumed_nearest_distance_(0.0),
+            knn_k_(0),
+            feature_dimension_(0),
+            cluster_node_array_(NULL),
+            cluster_node_capacity_(0),
+            distance_calculator_type_(type) {
         distance_calculator_ =
                 DistanceCalculatorFactory::createCalculator(type);
     }
@@ -107,13 +382,91 @@ public:
 
     bool init(int base_node_num, const std::string &distance_file_path);
 
+    // Init from a binary stream instead of a text file, for an upstream job
+    // piping the distances in: stream_path is a file, a named pipe or "-"
+    // for stdin. The stream is a sequence of 12 byte records
+    // (uint32 left label, uint32 right label, float distance) in the byte
+    // order of the machine, the labels are the line numbers (from 0) of the
+    // samples in name_file_path, one name per line. The stream may be gzip
+    // or zstd compressed, it is read and decompressed by a LineReader ahead
+    // of the records going straight into the matrix.
+    // Duplicate collapse is not supported for streams.
+    bool initFromBinaryStream(int base_node_num,
+            const std::string &name_file_path,
+            const std::string &stream_path);
+
+    // Init from a feature file instead of a distance file, one sample per
+    // line: name \t feature_1 \t feature_2 ... The distance of two samples is
+    // the euclidean distance of their features, squared for CENTROID and
+    // WARD, as the Lance-Williams updates of these linkages expect.
+    // With knn_k <= 0 the whole matrix is computed and the cluster is exact.
+    // With knn_k > 0 the memory and the time are O(n * knn_k) instead of
+    // O(n ^ 2): doCluster() only looks at the approximate knn_k nearest
+    // neighbors of each sample, and at the union of the candidates of the
+    // children for a merged node. A distance the Lance-Williams update can
+    // not give, because a child never met the candidate, is computed from the
+    // centroids: exact for CENTROID and WARD, the centroid distance as a
+    // proxy for the other linkages. The components of the knn graph are
+    // linked through their samples closest to the centroids, so every node
+    // keeps some candidates, and the last few hundred nodes all know each
+    // other, so the top of the tree compares all the pairs.
+    // Duplicate collapse, checkpoints and the out-of-core
+    // matrix only apply to the exact mode.
+    bool initFromFeatures(int base_node_num,
+            const std::string &feature_file_path,
+            int knn_k);
+
+    // Init from a clusterer which has been initialized but not clustered, so
+    // that one loaded matrix can be clustered with several linkages.
+    // With copy_on_write the base must use SHARED_MEMORY storage and must not
+    // be clustered itself; otherwise the matrix is copied. An out-of-core
+    // base is always copied, to the out-of-core file of this clusterer.
+    // The loaded distances of collapsed duplicates are weighted for the
+    // linkage of the base, so a collapsed base only serves linkages which
+    // weight them alike: WARD and the other linkages do not mix.
+    bool initFrom(const AgglHierClusterer &base, bool copy_on_write);
+
     bool loadDistanceMatrix(const std::string &file_ame);
 
+    // The distance matrix is useless after doCluster(), free it before output
+    void releaseDistanceMatrix();
+
     bool doCluster();
 
     bool output(const std::string &file_name, float distance_threshold);
 
     bool output(const std::string &file_name);
+
+    // Save a clustered tree in a binary file, which load() can read back to
+    // insert new samples. No distance matrix is needed for insert(): the
+    // distance between a new sample and a node follows from the distances to
+    // its two children and their merge distance, so the tree is enough.
+    bool save(const std::string &file_name) const;
+
+    // Load a tree saved by save(); the linkage is the one of the saved tree
+    bool load(const std::string &file_name);
+
+    // Place a new sample into the clustered tree. leaf_distances[label] is
+    // the distance between the sample and the leaf of that label, for every
+    // leaf; it has one entry per node and entries of other nodes are ignored.
+    // The placement is approximate: the linkage distance between the sample
+    // and every node is computed bottom-up, and the sample is merged with
+    // the closest node N such that the merge distance is not bigger than the
+    // merge distance of N's parent, at max(distance, merge distance of N).
+    // The rest of the tree is kept, so merges the sample would have changed
+    // in a full recluster are not redone. A sample within the duplicate
+    // epsilon of a leaf joins that leaf instead.
+    // quality, if not NULL, gets the correlation between the sample's
+    // distances to the leaves and its cophenetic distances in the new tree.
+    bool insert(const std::string &sample_name,
+            const std::vector<float> &leaf_distances,
+            float *quality);
+
+    // Insert all the new samples of a distance file in the text format of
+    // init(), in the order they first appear. For each new sample the file
+    // must have its distances to all existing leaves and to the new samples
+    // before it. The cost is linear in the size of the tree per sample.
+    bool insert(const std::string &distance_file_path);
 };
 }  // namespace cluster
 
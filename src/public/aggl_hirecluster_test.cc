@@ -3,13 +3,303 @@
 //
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "aggl_hier_clusterer.h"
+#include "cluster_checkpoint.h"
+
+using cluster::AgglHierClusterer;
+using cluster::ClusterCheckpoint;
+using cluster::DistanceCalculatorType;
+using cluster::DistanceMatrixStorageType;
+
+// Every mode but plain builds the tree through another path of the
+// clusterer, its output is compared with the plain run of the same input:
+//   plain          init() and doCluster()
+//   collapse       duplicate samples collapsed (epsilon 0)
+//   copy           initFrom() a copy-on-write AVERAGE base
+//   collapse_copy  initFrom() a collapsed AVERAGE base, fails for WARD
+//   out_of_core    the matrix in a file next to outfile
+//   stream         the distances converted to a binary stream
+//   resume         killed after a checkpoint, then resumed
+//   insert         the last tenth of the samples inserted into the saved
+//                  and loaded tree of the others
+static const char *modes[] = {"plain", "collapse", "copy", "collapse_copy",
+        "out_of_core", "stream", "resume", "insert"};
+
+static bool parseDistanceLine(const char *line, std::string *left_name,
+        std::string *right_name, float *distance) {
+    const char *left_end = strchr(line, '\t');
+    const char *right_end =
+            left_end == NULL ? NULL : strchr(left_end + 1, '\t');
+    if (right_end == NULL) {
+        return false;
+    }
+    left_name->assign(line, left_end - line);
+    right_name->assign(left_end + 1, right_end - left_end - 1);
+    *distance = atof(right_end + 1);
+    return true;
+}
+
+/*
+* Convert a text distance file to the names and the binary stream of
+* initFromBinaryStream(), the samples are labeled in the order they appear
+* as init() does
+*/
+static bool writeStream(const std::string &distance_file,
+        const std::string &name_file,
+        const std::string &stream_file) {
+    FILE *in_file = fopen(distance_file.c_str(), "r");
+    FILE *stream = fopen(stream_file.c_str(), "wb");
+    FILE *names = fopen(name_file.c_str(), "w");
+    bool success = in_file != NULL && stream != NULL && names != NULL;
+    std::map<std::string, uint32_t> labels;
+    char line[1024];
+    while (success && fgets(line, sizeof(line), in_file) != NULL) {
+        std::string sample_names[2];
+        float distance = 0.0;
+        if (!parseDistanceLine(line, &sample_names[0], &sample_names[1],
+                &distance)) {
+            continue;
+        }
+        uint32_t record[3];
+        for (int i = 0; i < 2; ++i) {
+            std::map<std::string, uint32_t>::iterator it =
+                    labels.find(sample_names[i]);
+            if (it == labels.end()) {
+                it = labels.insert(std::make_pair(sample_names[i],
+                        (uint32_t)labels.size())).first;
+                fprintf(names, "%s\n", sample_names[i].c_str());
+            }
+            record[i] = it->second;
+        }
+        memcpy(&record[2], &distance, sizeof(float));
+        success = fwrite(record, sizeof(record), 1, stream) == 1;
+    }
+    success = success && !ferror(in_file);
+    if (in_file != NULL) {
+        fclose(in_file);
+    }
+    if (stream != NULL) {
+        success = fclose(stream) == 0 && success;
+    }
+    if (names != NULL) {
+        success = fclose(names) == 0 && success;
+    }
+    return success;
+}
+
+/*
+* Split a text distance file: the pairs of the first base_node_num samples
+* to appear go to base_file, the pairs of the later samples to new_file
+*/
+static bool splitSamples(const std::string &distance_file,
+        int base_node_num,
+        const std::string &base_file,
+        const std::string &new_file) {
+    FILE *in_file = fopen(distance_file.c_str(), "r");
+    FILE *base_out = fopen(base_file.c_str(), "w");
+    FILE *new_out = fopen(new_file.c_str(), "w");
+    bool success = in_file != NULL && base_out != NULL && new_out != NULL;
+    std::map<std::string, int> labels;
+    char line[1024];
+    while (success && fgets(line, sizeof(line), in_file) != NULL) {
+        std::string left_name;
+        std::string right_name;
+        float distance = 0.0;
+        if (!parseDistanceLine(line, &left_name, &right_name, &distance)) {
+            continue;
+        }
+        labels.insert(std::make_pair(left_name, (int)labels.size()));
+        labels.insert(std::make_pair(right_name, (int)labels.size()));
+        bool is_base = labels[left_name] < base_node_num
+                && labels[right_name] < base_node_num;
+        success = fputs(line, is_base ? base_out : new_out) >= 0;
+    }
+    success = success && !ferror(in_file);
+    if (in_file != NULL) {
+        fclose(in_file);
+    }
+    if (base_out != NULL) {
+        success = fclose(base_out) == 0 && success;
+    }
+    if (new_out != NULL) {
+        success = fclose(new_out) == 0 && success;
+    }
+    return success;
+}
+
+/*
+* Run the cluster in a child process which is killed once it has written a
+* checkpoint with some merges. The child only runs for short slices, so
+* even a small input is still clustering when the first checkpoint is due.
+*/
+static bool killAfterCheckpoint(DistanceCalculatorType::Type type,
+        int basic_node_num,
+        const std::string &distance_file,
+        const std::string &checkpoint_file) {
+    remove(checkpoint_file.c_str());
+    int ready_pipe[2];
+    if (pipe(ready_pipe) != 0) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        AgglHierClusterer clusterer(type);
+        clusterer.setCheckpoint(checkpoint_file, 1);
+        bool success = clusterer.init(basic_node_num, distance_file);
+        char ready = 1;
+        if (write(ready_pipe[1], &ready, 1) != 1) {
+            _exit(1);
+        }
+        _exit(success && clusterer.doCluster() ? 0 : 1);
+    }
+    close(ready_pipe[1]);
+    char ready = 0;
+    bool initialized = read(ready_pipe[0], &ready, 1) == 1;
+    close(ready_pipe[0]);
+
+    bool exited = !initialized;
+    ClusterCheckpoint checkpoint;
+    struct stat file_stat;
+    while (!exited) {
+        if (stat(checkpoint_file.c_str(), &file_stat) == 0
+                && checkpoint.read(checkpoint_file)
+                && !checkpoint.merges.empty()) {
+            break;
+        }
+        kill(pid, SIGCONT);
+        usleep(1000);
+        kill(pid, SIGSTOP);
+        usleep(100000);
+        exited = waitpid(pid, NULL, WNOHANG) == pid;
+    }
+    if (!exited) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    remove((checkpoint_file + ".tmp").c_str());
+    if (exited) {
+        fprintf(stderr, "The cluster ended before a checkpoint!\n");
+        return false;
+    }
+    fprintf(stderr, "Killed after a checkpoint of %lu merges\n",
+            checkpoint.merges.size());
+    return true;
+}
+
+/*
+* Cluster distance_file with type in the given mode, *clusterer gets the
+* clustered tree
+*/
+static bool runMode(const std::string &mode,
+        DistanceCalculatorType::Type type,
+        int basic_node_num,
+        const std::string &distance_file,
+        const std::string &outfile,
+        AgglHierClusterer **clusterer) {
+    *clusterer = new AgglHierClusterer(type);
+    if (mode == "plain") {
+        return (*clusterer)->init(basic_node_num, distance_file)
+                && (*clusterer)->doCluster();
+    }
+    if (mode == "collapse") {
+        (*clusterer)->setDuplicateEpsilon(0.0);
+        return (*clusterer)->init(basic_node_num, distance_file)
+                && (*clusterer)->doCluster();
+    }
+    if (mode == "copy" || mode == "collapse_copy") {
+        AgglHierClusterer base(DistanceCalculatorType::AVERAGE);
+        base.setDistanceMatrixStorageType(
+                DistanceMatrixStorageType::SHARED_MEMORY);
+        if (mode == "collapse_copy") {
+            base.setDuplicateEpsilon(0.0);
+        }
+        return base.init(basic_node_num, distance_file)
+                && (*clusterer)->initFrom(base, true)
+                && (*clusterer)->doCluster();
+    }
+    if (mode == "out_of_core") {
+        std::string matrix_file = outfile + ".matrix";
+        remove(matrix_file.c_str());
+        (*clusterer)->setOutOfCoreFile(matrix_file);
+        return (*clusterer)->init(basic_node_num, distance_file)
+                && (*clusterer)->doCluster();
+    }
+    if (mode == "stream") {
+        std::string name_file = outfile + ".names";
+        std::string stream_file = outfile + ".stream";
+        bool success = writeStream(distance_file, name_file, stream_file)
+                && (*clusterer)->initFromBinaryStream(basic_node_num,
+                        name_file, stream_file)
+                && (*clusterer)->doCluster();
+        remove(name_file.c_str());
+        remove(stream_file.c_str());
+        return success;
+    }
+    if (mode == "resume") {
+        std::string checkpoint_file = outfile + ".checkpoint";
+        if (!killAfterCheckpoint(type, basic_node_num, distance_file,
+                checkpoint_file)) {
+            return false;
+        }
+        (*clusterer)->setCheckpoint(checkpoint_file, 1);
+        if (!(*clusterer)->init(basic_node_num, distance_file)) {
+            return false;
+        }
+        if ((*clusterer)->getNodeNum() == (*clusterer)->getBaseNodeNum()) {
+            fprintf(stderr, "The checkpoint was not resumed!\n");
+            return false;
+        }
+        return (*clusterer)->doCluster();
+    }
+    if (mode == "insert") {
+        int new_node_num = basic_node_num / 10 > 0 ? basic_node_num / 10 : 1;
+        std::string base_file = outfile + ".base";
+        std::string new_file = outfile + ".new";
+        std::string tree_file = outfile + ".tree";
+        bool success = basic_node_num > new_node_num + 1
+                && splitSamples(distance_file,
+                        basic_node_num - new_node_num, base_file, new_file)
+                && (*clusterer)->init(basic_node_num - new_node_num,
+                        base_file)
+                && (*clusterer)->doCluster()
+                && (*clusterer)->save(tree_file);
+        delete *clusterer;
+        *clusterer = new AgglHierClusterer(type);
+        success = success && (*clusterer)->load(tree_file)
+                && (*clusterer)->insert(new_file);
+        remove(base_file.c_str());
+        remove(new_file.c_str());
+        remove(tree_file.c_str());
+        return success;
+    }
+    fprintf(stderr, "Unknown mode %s\n", mode.c_str());
+    return false;
+}
 
 int main(int argc, char ** argv) {
-    if (argc != 5) {
+    if (argc < 5 || argc > 7) {
         fprintf(stderr, "Usage: aggl_hiercluser_test distance_file"
-                " basic_node_num distance_threshold outfile\n");
+                " basic_node_num distance_threshold outfile [mode [linkage]]"
+                "\nmodes:");
+        for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+            fprintf(stderr, " %s", modes[i]);
+        }
+        fprintf(stderr, "\n");
         return 1;
     }
     int basic_node_num = atoi(argv[2]);
@@ -18,16 +308,28 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "Node num must bigger than zero!");
         return 1;
     }
-    // for test, use AVERAGE distance function
-    cluster::AgglHierClusterer* clusterer = new cluster::AgglHierClusterer();
-    fprintf(stderr, "====start to init the clusterer====\n");
-    if (!clusterer->init(basic_node_num, argv[1])) {
-        fprintf(stderr, "====init clusterer failed!\n");
-        return 1;
+    std::string mode = argc > 5 ? argv[5] : "plain";
+    // for test, use AVERAGE distance function unless another one is given
+    DistanceCalculatorType::Type type = DistanceCalculatorType::AVERAGE;
+    if (argc > 6) {
+        int i = DistanceCalculatorType::SINGLE_LINK;
+        for (; i <= DistanceCalculatorType::WARD; ++i) {
+            if (strcmp(argv[6], DistanceCalculatorType::getName(
+                    (DistanceCalculatorType::Type)i)) == 0) {
+                break;
+            }
+        }
+        if (i > DistanceCalculatorType::WARD) {
+            fprintf(stderr, "Unknown linkage %s\n", argv[6]);
+            return 1;
+        }
+        type = (DistanceCalculatorType::Type)i;
     }
-    fprintf(stderr, "====start to aggregate nodes====\n");
-    if (!clusterer->doCluster()) {
+    AgglHierClusterer* clusterer = NULL;
+    fprintf(stderr, "====start to cluster in mode %s====\n", mode.c_str());
+    if (!runMode(mode, type, basic_node_num, argv[1], argv[4], &clusterer)) {
         fprintf(stderr, "====cluster nodes failed!\n");
+        delete clusterer;
         return 1;
     }
     fprintf(stderr, "====start output to file===\n");
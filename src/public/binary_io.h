@@ -0,0 +1,42 @@
+//
+// Helpers for the binary files of the clusterer.
+//
+
+#ifndef _NNHCLUS_BINARYIO_H_
+#define _NNHCLUS_BINARYIO_H_
+
+#include <cstdio>
+#include <string>
+
+namespace cluster {
+
+// Values are stored in the byte order of the machine
+
+template <typename T>
+inline bool writeValue(FILE *file, const T &value) {
+    return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template <typename T>
+inline bool readValue(FILE *file, T *value) {
+    return fread(value, sizeof(T), 1, file) == 1;
+}
+
+inline bool writeString(FILE *file, const std::string &value) {
+    unsigned int size = value.size();
+    return writeValue(file, size)
+            && (size == 0 || fwrite(value.data(), size, 1, file) == 1);
+}
+
+inline bool readString(FILE *file, std::string *value) {
+    unsigned int size = 0;
+    if (!readValue(file, &size)) {
+        return false;
+    }
+    value->resize(size);
+    return size == 0 || fread(&(*value)[0], size, 1, file) == 1;
+}
+
+}  // namespace cluster
+
+#endif //_NNHCLUS_BINARYIO_H_
@@ -0,0 +1,93 @@
+//
+// Checkpoints of a running doCluster().
+//
+
+#ifndef _NNHCLUS_CLUSTERCHECKPOINT_H_
+#define _NNHCLUS_CLUSTERCHECKPOINT_H_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cluster_node.h"
+
+namespace cluster {
+
+// State of doCluster() as the merges done so far and the nearest neighbor
+// chain. The distance matrix is not saved: it is reloaded from the input and
+// the merges are replayed on it, which gives the same matrix. input_identity
+// makes sure the input is the same one.
+struct ClusterCheckpoint {
+    int linkage_type;
+
+    int base_node_num;
+
+    int sample_num;
+
+    float duplicate_epsilon;
+
+    std::string input_identity;
+
+    // the merged nodes in the order they were created: children and merge
+    // distance
+    std::vector<ClusterNode> merges;
+
+    std::vector<int> chain;  // bottom to top
+
+    int nearest_neighbor_label;  // nearest neighbor of the chain top
+
+    float nearest_distance;
+
+    ClusterCheckpoint():
+            linkage_type(0),
+            base_node_num(0),
+            sample_num(0),
+            duplicate_epsilon(-1.0),
+            nearest_neighbor_label(-1),
+            nearest_distance(0.0) {}
+
+    // Write to file_name.tmp and rename it, so that file_name is always a
+    // complete checkpoint
+    bool write(const std::string &file_name) const;
+
+    bool read(const std::string &file_name);
+};
+
+// Write checkpoints on a background thread, one at a time
+class CheckpointWriter {
+private:
+    std::string file_name_;
+
+    std::thread thread_;
+
+    std::atomic<bool> busy_;
+
+    CheckpointWriter(const CheckpointWriter &);
+    CheckpointWriter &operator=(const CheckpointWriter &);
+
+    static void run(CheckpointWriter *writer, ClusterCheckpoint *checkpoint);
+
+public:
+    explicit CheckpointWriter(const std::string &file_name):
+            file_name_(file_name),
+            busy_(false) {}
+
+    ~CheckpointWriter() {
+        wait();
+    }
+
+    bool isBusy() const {
+        return busy_;
+    }
+
+    // Start writing checkpoint, which is deleted when written. Must not be
+    // called while busy.
+    void write(ClusterCheckpoint *checkpoint);
+
+    void wait();
+};
+
+}  // namespace cluster
+
+#endif //_NNHCLUS_CLUSTERCHECKPOINT_H_
@@ -16,6 +16,23 @@ public:
         AVERAGE,
         WARD
     };
+
+    static const char *getName(Type type) {
+        switch (type) {
+            case SINGLE_LINK:
+                return "single_link";
+            case COMPLETE_LINK:
+                return "complete_link";
+            case CENTROID:
+                return "centroid";
+            case AVERAGE:
+                return "average";
+            case WARD:
+                return "ward";
+            default:
+                return "unknown";
+        }
+    }
 };
 
 // Calculate the distance between an exist node and a new node which
@@ -32,6 +49,14 @@ public:
             float dis_left_right  // distance between left and right
     ) const = 0;
 
+    // Distance between two leaves made of m_left and m_right identical
+    // samples, whose samples are at the given distance from each other
+    virtual float weightedDistance(int m_left,
+            int m_right,
+            float distance) const {
+        return distance;
+    }
+
     virtual ~DistanceCalculator() {}
 
     friend class DistanceCalculatorFactory;
@@ -114,6 +139,12 @@ public:
                 - (float)m_cur * dis_left_right / (m_left + m_right + m_cur);
     }
 
+    virtual float weightedDistance(int m_left,
+            int m_right,
+            float distance) const {
+        return 2.0f * m_left * m_right * distance / (m_left + m_right);
+    }
+
     virtual ~WardDistanceCalculator() {}
 };
 
@@ -0,0 +1,113 @@
+//
+// Storage of the packed distance matrix.
+//
+
+#ifndef _NNHCLUS_DISTANCEMATRIXSTORAGE_H_
+#define _NNHCLUS_DISTANCEMATRIXSTORAGE_H_
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct iovec;
+
+namespace cluster {
+
+class DistanceMatrixStorageType {
+public:
+    enum Type {
+        HEAP = 0,  // plain new float[]
+        SHARED_MEMORY,  // shared memory object, can be mapped copy-on-write
+        PRIVATE_MAPPING,  // copy-on-write mapping of a SHARED_MEMORY storage
+        FILE_MAPPING  // shared mapping of a file, for matrices bigger than RAM
+    };
+};
+
+// Owner of the memory behind the packed distance matrix. The clusterer only
+// works on the raw float pointer, this class decides where the floats live
+// and how they are released.
+class DistanceMatrixStorage {
+private:
+    float *data_;
+
+    size_t float_num_;
+
+    int fd_;  // backing shared memory object, -1 if there is none
+
+    // pidfd of this process for process_madvise(), -1 if not opened yet,
+    // -2 if the kernel lacks it and prefetch() falls back to madvise()
+    mutable int pidfd_;
+
+    DistanceMatrixStorageType::Type type_;
+
+    void adviseWillNeed(const struct iovec *ranges, size_t range_num) const;
+
+    // not copyable, the storage owns a mapping or an array
+    DistanceMatrixStorage(const DistanceMatrixStorage &);
+    DistanceMatrixStorage &operator=(const DistanceMatrixStorage &);
+
+public:
+    DistanceMatrixStorage():
+            data_(NULL),
+            float_num_(0),
+            fd_(-1),
+            pidfd_(-1),
+            type_(DistanceMatrixStorageType::HEAP) {}
+
+    ~DistanceMatrixStorage() {
+        release();
+    }
+
+    float *getData() const {
+        return data_;
+    }
+
+    size_t getFloatNum() const {
+        return float_num_;
+    }
+
+    size_t getByteSize() const {
+        return float_num_ * sizeof(float);
+    }
+
+    DistanceMatrixStorageType::Type getType() const {
+        return type_;
+    }
+
+    // Allocate float_num uninitialized floats. Only HEAP and SHARED_MEMORY
+    // can be allocated directly. No memory is allocated for 0 floats,
+    // getData() stays NULL.
+    bool allocate(size_t float_num, DistanceMatrixStorageType::Type type);
+
+    // Make this storage a pristine heap copy of base
+    bool copyFrom(const DistanceMatrixStorage &base);
+
+    // Create the file at path and map float_num floats of it. An existing
+    // file is never overwritten, the call fails instead. The file is
+    // unlinked at once, its disk space is freed by release(). The mapping is
+    // advised as random access, use prefetch() for the ranges about to be
+    // read.
+    bool mapFile(const std::string &path, size_t float_num);
+
+    // Make this storage a FILE_MAPPING at path holding a copy of the
+    // FILE_MAPPING base, the copy is done by the file system when it can.
+    bool copyToFile(const DistanceMatrixStorage &base,
+            const std::string &path);
+
+    // Hint the kernel to start reading the (begin, float_num) ranges in the
+    // background. The ranges are handed over in batches through
+    // process_madvise() where the kernel has it. Only meaningful for
+    // FILE_MAPPING.
+    void prefetch(const std::vector<std::pair<size_t, size_t> > &ranges) const;
+
+    // Map a SHARED_MEMORY base privately: pages are shared with base until
+    // they are written. The base must not be modified afterwards.
+    bool mapPrivate(const DistanceMatrixStorage &base);
+
+    void release();
+};
+
+}  // namespace cluster
+
+#endif //_NNHCLUS_DISTANCEMATRIXSTORAGE_H_
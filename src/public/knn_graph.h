@@ -0,0 +1,90 @@
+//
+// Approximate k nearest neighbor graph of feature vectors.
+//
+
+#ifndef _NNHCLUS_KNNGRAPH_H_
+#define _NNHCLUS_KNNGRAPH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace cluster {
+
+// k nearest neighbor graph built by NN-descent: start from random
+// neighbors and repeatedly try the neighbors of the neighbors, until few
+// neighbor lists change. The local joins run on several threads.
+// Distances are squared euclidean distances.
+class KnnGraph {
+private:
+    int node_num_;
+
+    int k_;
+
+    // k_ neighbors of each node, ascending by distance; the label is -1 if
+    // the node has less than k_ neighbors
+    std::vector<int> neighbor_labels_;
+
+    std::vector<float> neighbor_distances_;
+
+    // whether a neighbor has not taken part in a local join yet
+    std::vector<char> neighbor_is_new_;
+
+    // try to add label to the neighbors of node, return whether added
+    bool tryInsert(int node, int label, float distance);
+
+    // local join of one iteration for the nodes [begin, end)
+    void localJoin(const std::vector<std::vector<int> > *new_lists,
+            const std::vector<std::vector<int> > *old_lists,
+            int begin,
+            int end,
+            std::vector<std::mutex> *locks,
+            const float *features,
+            int dimension,
+            std::atomic<long> *update_num);
+
+public:
+    KnnGraph(): node_num_(0), k_(0) {}
+
+    // features holds node_num vectors of dimension floats, one after
+    // another. thread_num <= 0 means one thread per CPU.
+    bool build(const float *features,
+            int node_num,
+            int dimension,
+            int k,
+            int thread_num = 0,
+            int max_iteration = 12);
+
+    int getNodeNum() const {
+        return node_num_;
+    }
+
+    int getK() const {
+        return k_;
+    }
+
+    // ith nearest neighbor of node, -1 if there is none
+    int getNeighbor(int node, int i) const {
+        return neighbor_labels_[(size_t)node * k_ + i];
+    }
+
+    float getNeighborDistance(int node, int i) const {
+        return neighbor_distances_[(size_t)node * k_ + i];
+    }
+
+    static float squaredDistance(const float *left,
+            const float *right,
+            int dimension) {
+        float distance = 0.0;
+        for (int i = 0; i < dimension; ++i) {
+            float diff = left[i] - right[i];
+            distance += diff * diff;
+        }
+        return distance;
+    }
+};
+
+}  // namespace cluster
+
+#endif //_NNHCLUS_KNNGRAPH_H_
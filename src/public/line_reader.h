@@ -0,0 +1,181 @@
+//
+// Pipelined line and block reader of plain, gzip and zstd files.
+//
+
+#ifndef _NNHCLUS_LINEREADER_H_
+#define _NNHCLUS_LINEREADER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cluster {
+
+class InputFormat {
+public:
+    enum Type {
+        PLAIN = 0,
+        GZIP,  // decompressed sequentially
+        BGZF,  // gzip members with their size in the header, as bgzip
+               // writes them, decompressed in parallel
+        ZSTD  // frames decompressed in parallel
+    };
+
+    static const char *getName(Type type) {
+        switch (type) {
+            case PLAIN:
+                return "plain";
+            case GZIP:
+                return "gzip";
+            case BGZF:
+                return "bgzf";
+            case ZSTD:
+                return "zstd";
+            default:
+                return "unknown";
+        }
+    }
+};
+
+// Read the lines or the raw blocks of a file which may be compressed, the
+// format is detected from the magic bytes. Reading and decompression run on their
+// own threads, ahead of the caller which parses and stores the lines:
+// a splitter thread reads the file and cuts it into chunks, the gzip
+// members of a BGZF file or the frames of a zstd file are decompressed by
+// a pool of threads, other inputs by the splitter itself. Decompressed
+// chunks reach the caller in the order of the file through a bounded queue.
+class LineReader {
+private:
+    struct Chunk {
+        size_t sequence;
+        std::vector<char> data;  // compressed until decompressed
+    };
+
+    int thread_num_;  // decompress threads, for BGZF and ZSTD
+
+    FILE *file_;
+
+    InputFormat::Type format_;
+
+    std::string peeked_;  // magic bytes read by open(), not consumed yet
+
+    bool input_end_;  // the splitter has read the whole file
+
+    std::thread splitter_;
+
+    std::vector<std::thread> workers_;
+
+    mutable std::mutex mutex_;
+
+    std::condition_variable job_ready_;
+
+    std::condition_variable chunk_done_;
+
+    std::condition_variable window_free_;
+
+    std::deque<Chunk *> jobs_;  // compressed chunks for the workers
+
+    std::map<size_t, Chunk *> done_chunks_;  // decompressed, by sequence
+
+    size_t next_sequence_;  // sequence of the next chunk of the splitter
+
+    size_t consumed_sequence_;  // sequence of the next chunk of the caller
+
+    bool split_finished_;
+
+    // set by the splitter and the workers, read by the caller without the
+    // lock
+    std::atomic<bool> failed_;
+
+    bool stopping_;
+
+    Chunk *chunk_;  // chunk the caller is reading lines from
+
+    size_t chunk_offset_;
+
+    // stage statistics: bytes and busy seconds
+    size_t read_bytes_;
+
+    double read_seconds_;
+
+    size_t decompressed_bytes_;
+
+    double decompress_seconds_;  // summed over the threads
+
+    size_t parsed_bytes_;  // handed to the caller
+
+    double wait_seconds_;  // caller waiting for decompressed chunks
+
+    double open_time_;
+
+    LineReader(const LineReader &);
+    LineReader &operator=(const LineReader &);
+
+    // read size bytes, the peeked ones first; less only at the end
+    size_t readInput(char *buffer, size_t size);
+
+    // hand a chunk to the pipeline, decompressed or not; false if stopping
+    bool submit(Chunk *chunk, bool decompressed);
+
+    void splitLoop();
+
+    bool splitPlain();
+
+    bool splitGzip();
+
+    bool splitBgzf();
+
+    bool splitZstd();
+
+    void workLoop();
+
+    bool decompress(const std::vector<char> &input, std::vector<char> *output);
+
+    Chunk *nextChunk();
+
+public:
+    // thread_num <= 0 means one decompress thread per CPU
+    explicit LineReader(int thread_num = 0);
+
+    ~LineReader() {
+        close();
+    }
+
+    // path "-" is stdin, which is never closed
+    bool open(const std::string &path);
+
+    // Next line without the line break. Return false at the end of the
+    // file or on an error, see isFailed().
+    bool readLine(std::string *line);
+
+    // Next block of decompressed bytes, for binary inputs: the rest of the
+    // current chunk, valid until the next read. Blocks are cut anywhere,
+    // a record may go on in the next block. Return false at the end of the
+    // file or on an error, see isFailed().
+    bool readBlock(const char **data, size_t *size);
+
+    bool isFailed() const {
+        return failed_;
+    }
+
+    InputFormat::Type getFormat() const {
+        return format_;
+    }
+
+    // print the throughput of reading, decompression and the caller's
+    // parsing, so that the slowest stage shows
+    void reportThroughput() const;
+
+    void close();
+};
+
+}  // namespace cluster
+
+#endif //_NNHCLUS_LINEREADER_H_
@@ -0,0 +1,72 @@
+//
+// Cluster one distance matrix with several linkages.
+//
+
+#ifndef _NNHCLUS_MULTILINKAGECLUSTERER_H_
+#define _NNHCLUS_MULTILINKAGECLUSTERER_H_
+
+#include <string>
+#include <vector>
+
+#include "aggl_hier_clusterer.h"
+#include "distance_calculator.h"
+
+namespace cluster {
+// Load the distance matrix once and cluster it with every linkage in the
+// list. Each linkage works on its own copy of the matrix: either a pristine
+// heap copy or a copy-on-write private mapping of the loaded base, which only
+// costs memory for the pages the linkage really modifies.
+// Linkages run concurrently on separate threads as long as the available
+// memory can hold their copies.
+class MultiLinkageClusterer {
+private:
+    std::vector<DistanceCalculatorType::Type> types_;
+
+    bool copy_on_write_;
+
+    int max_thread_num_;  // <= 0 means no limit other than memory
+
+    AgglHierClusterer *base_clusterer_;  // holds the loaded matrix
+
+    std::vector<AgglHierClusterer *> clusterers_;  // one per linkage
+
+private:
+    MultiLinkageClusterer(const MultiLinkageClusterer &);
+    MultiLinkageClusterer &operator=(const MultiLinkageClusterer &);
+
+    // how many linkages can be clustered at the same time
+    int getConcurrentNum() const;
+
+    std::string getOutputFileName(const std::string &file_prefix,
+            size_t linkage_index) const;
+
+public:
+    MultiLinkageClusterer(
+            const std::vector<DistanceCalculatorType::Type> &types,
+            bool copy_on_write = true,
+            int max_thread_num = 0);
+
+    ~MultiLinkageClusterer();
+
+    size_t getLinkageNum() const {
+        return types_.size();
+    }
+
+    // clusterer of the ith linkage, valid after doCluster()
+    AgglHierClusterer *getClusterer(size_t i) const {
+        return clusterers_[i];
+    }
+
+    bool init(int base_node_num, const std::string &distance_file_path);
+
+    bool doCluster();
+
+    // Output files are named file_prefix.<linkage name>, the clusters under
+    // distance_threshold get an extra .cluster suffix
+    bool output(const std::string &file_prefix, float distance_threshold);
+
+    bool output(const std::string &file_prefix);
+};
+}  // namespace cluster
+
+#endif //_NNHCLUS_MULTILINKAGECLUSTERER_H_